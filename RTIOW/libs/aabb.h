@@ -0,0 +1,155 @@
+#pragma once
+
+#include <algorithm>
+
+#include "common.h"
+
+#include "ray_packet.h"
+
+class aabb
+{
+public:
+	interval x, y, z;
+
+	aabb() {} // Default AABB is empty, since intervals are empty by default.
+
+	aabb(const interval& _x, const interval& _y, const interval& _z) : x(_x), y(_y), z(_z) {}
+
+	aabb(const point3& a, const point3& b)
+	{
+		// Treat the two points "a" and "b" as extrema for the bounding box, so we don't require a
+		// particular minimum/maximum coordinate order.
+		x = (a[0] <= b[0]) ? interval(a[0], b[0]) : interval(b[0], a[0]);
+		y = (a[1] <= b[1]) ? interval(a[1], b[1]) : interval(b[1], a[1]);
+		z = (a[2] <= b[2]) ? interval(a[2], b[2]) : interval(b[2], a[2]);
+	}
+
+	aabb(const aabb& box0, const aabb& box1) : x(box0.x, box1.x), y(box0.y, box1.y), z(box0.z, box1.z) {}
+
+	const interval& axis_interval(int n) const
+	{
+		if (n == 1) return y;
+		if (n == 2) return z;
+
+		return x;
+	}
+
+	int longest_axis() const
+	{
+		// Returns the index of the longest axis of the bounding box.
+		if (x.size() > y.size())
+		{
+			return x.size() > z.size() ? 0 : 2;
+		}
+
+		return y.size() > z.size() ? 1 : 2;
+	}
+
+	bool hit(const ray& r, const interval& ray_ti) const
+	{
+		// Slab test without branches, using the inverse direction the ray already holds.
+		const point3& origin = r.get_origin();
+		const vec3& inv_direction = r.get_inv_direction();
+
+		double tx0 = (x.min - origin.x()) * inv_direction.x();
+		double tx1 = (x.max - origin.x()) * inv_direction.x();
+		double ty0 = (y.min - origin.y()) * inv_direction.y();
+		double ty1 = (y.max - origin.y()) * inv_direction.y();
+		double tz0 = (z.min - origin.z()) * inv_direction.z();
+		double tz1 = (z.max - origin.z()) * inv_direction.z();
+
+		double enter = std::max(std::max(ray_ti.min, std::min(tx0, tx1)), std::max(std::min(ty0, ty1), std::min(tz0, tz1)));
+		double exit = std::min(std::min(ray_ti.max, std::max(tx0, tx1)), std::min(std::max(ty0, ty1), std::max(tz0, tz1)));
+
+		return enter < exit;
+	}
+
+	uint32_t hit_packet(const ray_packet& packet, uint32_t mask, double ray_tmin, const double* ray_tmax) const
+	{
+		// Returns the lanes of "mask" whose rays may hit the box. The result is conservative: when the
+		// first active lane hits, the whole mask is kept, which is cheap and tight enough for coherent packets.
+		int first_lane = 0;
+
+		while (first_lane < packet_size - 1 && !(mask & (1u << first_lane)))
+		{
+			first_lane++;
+		}
+
+		if (hit_lane(packet, first_lane, ray_tmin, ray_tmax[first_lane]))
+		{
+			return mask;
+		}
+
+		// Otherwise, cull the whole packet at once with interval arithmetic over its origins and inverse
+		// directions, and only check the lanes one by one when that can't prove a miss.
+		if (packet.coherent)
+		{
+			double enter = ray_tmin;
+			double exit = 0.0;
+
+			for (int lane = 0; lane < packet_size; ++lane)
+			{
+				exit = std::fmax(exit, (mask & (1u << lane)) ? ray_tmax[lane] : 0.0);
+			}
+
+			for (int axis = 0; axis < 3; axis++)
+			{
+				const interval& ax = axis_interval(axis);
+				interval t0 = interval_product(interval(ax.min - packet.origin_bounds[axis].max, ax.min - packet.origin_bounds[axis].min), packet.inv_direction_bounds[axis]);
+				interval t1 = interval_product(interval(ax.max - packet.origin_bounds[axis].max, ax.max - packet.origin_bounds[axis].min), packet.inv_direction_bounds[axis]);
+
+				enter = std::fmax(enter, std::fmin(t0.min, t1.min));
+				exit = std::fmin(exit, std::fmax(t0.max, t1.max));
+			}
+
+			if (exit <= enter)
+			{
+				return 0;
+			}
+		}
+
+		// Slab test of every lane, written without branches so the loop maps onto SIMD lanes.
+		uint32_t hits = 0;
+
+		for (int lane = 0; lane < packet_size; ++lane)
+		{
+			hits |= static_cast<uint32_t>(hit_lane(packet, lane, ray_tmin, ray_tmax[lane])) << lane;
+		}
+
+		return hits & mask;
+	}
+
+	static const aabb empty, universe;
+
+private:
+	bool hit_lane(const ray_packet& packet, int lane, double ray_tmin, double ray_tmax) const
+	{
+		double enter = ray_tmin;
+		double exit = ray_tmax;
+
+		for (int axis = 0; axis < 3; axis++)
+		{
+			const interval& ax = axis_interval(axis);
+			double t0 = (ax.min - packet.origin[axis][lane]) * packet.inv_direction[axis][lane];
+			double t1 = (ax.max - packet.origin[axis][lane]) * packet.inv_direction[axis][lane];
+
+			enter = std::max(enter, std::min(t0, t1));
+			exit = std::min(exit, std::max(t0, t1));
+		}
+
+		return enter < exit;
+	}
+
+	static interval interval_product(const interval& a, const interval& b)
+	{
+		double p0 = a.min * b.min;
+		double p1 = a.min * b.max;
+		double p2 = a.max * b.min;
+		double p3 = a.max * b.max;
+
+		return interval(std::fmin(std::fmin(p0, p1), std::fmin(p2, p3)), std::fmax(std::fmax(p0, p1), std::fmax(p2, p3)));
+	}
+};
+
+const aabb aabb::empty = aabb(interval(+infinity, -infinity), interval(+infinity, -infinity), interval(+infinity, -infinity));
+const aabb aabb::universe = aabb(interval(-infinity, +infinity), interval(-infinity, +infinity), interval(-infinity, +infinity));
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <algorithm>
+
+#include "common.h"
+
+#include "aabb.h"
+#include "hittable.h"
+#include "hittable_list.h"
+
+class bvh_node : public hittable
+{
+public:
+	bvh_node(hittable_list list) : bvh_node(list.objects, 0, list.objects.size())
+	{
+		// There's a C++ subtlety here. This constructor (without span indices) creates an implicit copy
+		// of the hittable list, which we will modify. The lifetime of the copied list only extends until
+		// this constructor exits. That's OK, because we only need to persist the resulting bounding
+		// volume hierarchy.
+	}
+
+	bvh_node(std::vector<std::shared_ptr<hittable>>& objects, size_t start, size_t end)
+	{
+		// Build the bounding box of the span of source objects.
+		bbox = aabb::empty;
+
+		for (size_t object_index = start; object_index < end; object_index++)
+		{
+			bbox = aabb(bbox, objects[object_index]->bounding_box());
+		}
+
+		int axis = bbox.longest_axis();
+		size_t object_span = end - start;
+
+		if (object_span == 1)
+		{
+			left = right = objects[start];
+		}
+		else if (object_span == 2)
+		{
+			left = objects[start];
+			right = objects[start + 1];
+		}
+		else
+		{
+			std::sort(objects.begin() + start, objects.begin() + end, [axis](const std::shared_ptr<hittable>& a, const std::shared_ptr<hittable>& b) {
+				return a->bounding_box().axis_interval(axis).min < b->bounding_box().axis_interval(axis).min;
+			});
+
+			size_t mid = start + object_span / 2;
+
+			left = std::make_shared<bvh_node>(objects, start, mid);
+			right = std::make_shared<bvh_node>(objects, mid, end);
+		}
+	}
+
+	bool hit(const ray& r, interval ray_ti, hit_record& rec) const override
+	{
+		if (!bbox.hit(r, ray_ti))
+		{
+			return false;
+		}
+
+		bool hit_left = left->hit(r, ray_ti, rec);
+		bool hit_right = right->hit(r, interval(ray_ti.min, hit_left ? rec.t : ray_ti.max), rec);
+
+		return hit_left || hit_right;
+	}
+
+	aabb bounding_box() const override
+	{
+		return bbox;
+	}
+
+	uint32_t hit_packet(const ray_packet& packet, uint32_t mask, double ray_tmin, packet_hit& hits) const override
+	{
+		uint32_t lanes = bbox.hit_packet(packet, mask, ray_tmin, hits.t_max);
+
+		if (lanes == 0)
+		{
+			return 0;
+		}
+
+		// Once the packet has diverged, the few rays left are cheaper to traverse alone.
+		if (lane_count(lanes) < packet_min_coherent_lanes)
+		{
+			return hittable::hit_packet(packet, lanes, ray_tmin, hits);
+		}
+
+		uint32_t hit_lanes = left->hit_packet(packet, lanes, ray_tmin, hits);
+
+		if (right != left)
+		{
+			hit_lanes |= right->hit_packet(packet, lanes, ray_tmin, hits);
+		}
+
+		return hit_lanes;
+	}
+
+private:
+	std::shared_ptr<hittable> left;
+	std::shared_ptr<hittable> right;
+	aabb bbox;
+};
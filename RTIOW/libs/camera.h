@@ -1,13 +1,46 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <vector>
+
 #include "common.h"
 
 #include "color.h"
+#include "environment.h"
 #include "hittable.h"
 #include "material.h"
+#include "post_process.h"
+#include "radiance_cache.h"
 #include "thread_pool.h"
+#include "tile_summary.h"
 
+// May already have been included, with its implementation, through "post_process.h".
+#ifndef INCLUDE_STB_IMAGE_WRITE_H
 #include "external/stbi/stb_image_write.h"
+#endif
+
+class render_report
+{
+public:
+	int tiles_x = 0; // Count of tile columns.
+	int tiles_y = 0; // Count of tile rows.
+	int tile_size = 0; // Width and height, in pixels, of each tile.
+	int passes = 0; // Count of passes that rendered at least one tile.
+	double elapsed = 0.0; // Wall-clock render time, in seconds.
+	std::vector<int> tile_samples; // Samples per pixel each tile actually got, in row-major order.
+
+	int min_samples() const
+	{
+		return tile_samples.empty() ? 0 : *std::min_element(tile_samples.begin(), tile_samples.end());
+	}
+
+	int max_samples() const
+	{
+		return tile_samples.empty() ? 0 : *std::max_element(tile_samples.begin(), tile_samples.end());
+	}
+};
 
 class camera
 {
@@ -25,6 +58,17 @@ public:
 	double defocus_angle = 0; // Variation angle of rays through each pixel.
 	double focus_distance = 10; // Distance from camera lookfrom point to plane of perfect focus.
 
+	std::shared_ptr<environment_light> environment; // HDR environment lighting the scene, replacing the sky gradient when set.
+	std::shared_ptr<radiance_cache> diffuse_cache; // Cache of diffuse radiance reused after the first diffuse bounce, when set. Only valid while the scene doesn't change.
+
+	double summary_cell_size = 0.5; // Edge of the world-space cells recorded in tile summaries.
+	int summary_depth = 3; // Count of path vertices recorded in tile summaries, since deeper ones hardly contribute. Changes seen only through longer chains of mirrors are missed.
+
+	double time_budget = 1.0; // Wall-clock budget, in seconds, of time-budgeted rendering.
+	int tile_size = 16; // Width and height, in pixels, of each tile of time-budgeted rendering.
+
+	bool use_packets = false; // Trace primary rays in coherent packets of neighbouring pixels.
+
 	void render(const hittable& world, const char* output_filename)
 	{
 		initialize();
@@ -60,41 +104,198 @@ public:
 
 	// Rendering with multirhreading.
 	void render_mt(const hittable& world, const char* output_filename)
+	{
+		post_process post;
+
+		post.transfer = transfer_function::gamma_2; // Square root, as in the book.
+		post.add_output(output_filename);
+
+		render_mt(world, post);
+	}
+
+	// Rendering with multithreading, handing the linear framebuffer to "post" for any number of outputs.
+	void render_mt(const hittable& world, post_process& post)
 	{
 		initialize();
 
-		unsigned char* buffer = new unsigned char[image_height * image_width * 3];
+		std::vector<float> pixels(image_height * image_width * 3);
 		double pixel_samples_scale = 1.0 / samples_per_pixel;
 		uint32_t completed_tasks = 0;
 		thread_pool tp;
 
-		for (int j = 0; j < image_height; ++j)
+		tp.print_progress = true;
+
+		if (use_packets)
 		{
-			for (int i = 0; i < image_width; ++i)
+			for (int j0 = 0; j0 < image_height; j0 += packet_width)
 			{
-				tp.enqueue([&, i, j] {
-					color pixel_color(0.0, 0.0, 0.0);
-					int stride = (j * image_width + i) * 3;
+				for (int i0 = 0; i0 < image_width; i0 += packet_width)
+				{
+					tp.enqueue([&, i0, j0] {
+						color pixel_colors[packet_size];
+						int i1 = std::min(i0 + packet_width, image_width);
+						int j1 = std::min(j0 + packet_width, image_height);
+
+						for (int sample = 0; sample < samples_per_pixel; ++sample)
+						{
+							sample_packet(world, i0, j0, i1, j1, pixel_colors);
+						}
+
+						for (int j = j0; j < j1; ++j)
+						{
+							for (int i = i0; i < i1; ++i)
+							{
+								int stride = (j * image_width + i) * 3;
+								int lane = (j - j0) * packet_width + (i - i0);
+
+								write_color_into_float_buffer(pixels.data(), stride, pixel_samples_scale * pixel_colors[lane]);
+							}
+						}
+					});
+				}
+			}
+		}
+		else
+		{
+			for (int j = 0; j < image_height; ++j)
+			{
+				for (int i = 0; i < image_width; ++i)
+				{
+					tp.enqueue([&, i, j] {
+						color pixel_color(0.0, 0.0, 0.0);
+						int stride = (j * image_width + i) * 3;
+
+						for (int sample = 0; sample < samples_per_pixel; ++sample)
+						{
+							ray r = get_ray(i, j);
+							pixel_color += get_ray_color(r, max_depth, world);
+						}
+
+						write_color_into_float_buffer(pixels.data(), stride, pixel_samples_scale * pixel_color);
+					});
+				}
+			}
+		}
+
+		tp.terminate();
+
+		post.write(pixels.data(), image_width, image_height);
+	}
+
+	// Rendering within a wall-clock budget, refining the whole frame progressively until the deadline.
+	render_report render_timed(const hittable& world, const char* output_filename)
+	{
+		using clock = std::chrono::steady_clock;
+
+		initialize();
+
+		clock::time_point start = clock::now();
+		clock::time_point deadline = start + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(time_budget));
 
-					for (int sample = 0; sample < samples_per_pixel; ++sample)
+		render_report report;
+		report.tile_size = tile_size;
+		report.tiles_x = (image_width + tile_size - 1) / tile_size;
+		report.tiles_y = (image_height + tile_size - 1) / tile_size;
+
+		int num_tiles = report.tiles_x * report.tiles_y;
+		std::vector<color> accumulator(image_width * image_height);
+		std::vector<double> tile_cost(num_tiles, 0.0); // Seconds per sample of each tile, measured on its last pass.
+		report.tile_samples.assign(num_tiles, 0);
+		thread_pool tp;
+
+		// The first pass covers the whole frame with one sample per pixel, regardless of the budget,
+		// so that every pixel ends up with a defined value.
+		int pass_samples = 1;
+		bool first_pass = true;
+
+		while (true)
+		{
+			std::atomic<int> rendered_tiles(0);
+
+			for (int tile = 0; tile < num_tiles; ++tile)
+			{
+				tp.enqueue([&, tile, pass_samples, first_pass] {
+					clock::time_point tile_start = clock::now();
+
+					// A tile either takes the whole batch of the pass or nothing, so it is never left half sampled.
+					if (!first_pass && tile_start + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(tile_cost[tile] * pass_samples)) > deadline)
 					{
-						ray r = get_ray(i, j);
-						pixel_color += get_ray_color(r, max_depth, world);
+						return;
 					}
 
-					write_color_into_buffer(buffer, stride, pixel_samples_scale * pixel_color);
+					render_tile(world, report.tiles_x, tile, pass_samples, [&](int i, int j, const color& pixel_color) {
+						accumulator[j * image_width + i] += pixel_color;
+					});
+
+					tile_cost[tile] = std::chrono::duration<double>(clock::now() - tile_start).count() / pass_samples;
+					report.tile_samples[tile] += pass_samples;
+					rendered_tiles++;
 				});
 			}
+
+			tp.wait();
+
+			if (rendered_tiles == 0)
+			{
+				break;
+			}
+
+			report.passes++;
+			first_pass = false;
+
+			double remaining = std::chrono::duration<double>(deadline - clock::now()).count();
+
+			if (remaining <= 0.0)
+			{
+				break;
+			}
+
+			// Size the next pass to take about half of the remaining time, so that passes shrink as the
+			// deadline approaches and the frame is refined evenly.
+			double frame_cost = 0.0;
+
+			for (double cost : tile_cost)
+			{
+				frame_cost += cost;
+			}
+
+			double affordable_samples = 0.5 * remaining * tp.size() / std::max(frame_cost, 1e-9);
+			pass_samples = static_cast<int>(std::min(std::max(affordable_samples, 1.0), 1e6));
 		}
 
 		tp.terminate();
 
+		// Normalize every pixel by the count of samples its tile actually got.
+		unsigned char* buffer = new unsigned char[image_height * image_width * 3];
+
+		for (int j = 0; j < image_height; ++j)
+		{
+			for (int i = 0; i < image_width; ++i)
+			{
+				int tile = (j / tile_size) * report.tiles_x + (i / tile_size);
+				int stride = (j * image_width + i) * 3;
+
+				write_color_into_buffer(buffer, stride, accumulator[j * image_width + i] / report.tile_samples[tile]);
+			}
+		}
+
+		report.elapsed = std::chrono::duration<double>(clock::now() - start).count();
+
+		std::clog << '\n' << "Done in " << report.elapsed << "s, " << report.passes << " passes, "
+				  << report.min_samples() << " to " << report.max_samples() << " samples per pixel." << std::endl;
+
 		stbi_write_jpg(output_filename, image_width, image_height, 3, buffer, 100);
 
 		delete[] buffer;
+
+		return report;
 	}
 
 private:
+	friend class incremental_render;
+	friend class render_queue;
+	friend class render_session;
+
 	int image_height; // Rendered image height.
 	point3 center; // Camera center.
 	point3 pixel00_loc;	// Location of pixel (0, 0).
@@ -141,6 +342,165 @@ private:
 		defocus_disk_v = v * defocus_radius;
 	}
 
+	bool get_screen_bounds(const aabb& box, int& i0, int& j0, int& i1, int& j1) const
+	{
+		// Inclusive range of the pixels whose primary rays may reach "box", or false if there are none.
+		// Each corner is projected from the corners of the defocus square: a point's image on the focus
+		// plane is linear in the lens position, so these bound every lens sample.
+		double i_min = infinity, i_max = -infinity, j_min = infinity, j_max = -infinity;
+		bool all_behind = true, any_behind = false;
+
+		for (int corner = 0; corner < 8; ++corner)
+		{
+			point3 p((corner & 1) ? box.x.max : box.x.min, (corner & 2) ? box.y.max : box.y.min, (corner & 4) ? box.z.max : box.z.min);
+			double depth = dot(center - p, w);
+
+			if (depth <= 1e-8)
+			{
+				any_behind = true;
+				continue;
+			}
+
+			all_behind = false;
+
+			for (int lens = 0; lens < 4; ++lens)
+			{
+				point3 origin = center + ((lens & 1) ? 1.0 : -1.0) * defocus_disk_u + ((lens & 2) ? 1.0 : -1.0) * defocus_disk_v;
+				vec3 offset = origin + (p - origin) * (focus_distance / depth) - pixel00_loc;
+				double i = dot(offset, pixel_delta_u) / pixel_delta_u.length_squared();
+				double j = dot(offset, pixel_delta_v) / pixel_delta_v.length_squared();
+
+				i_min = std::min(i_min, i);
+				i_max = std::max(i_max, i);
+				j_min = std::min(j_min, j);
+				j_max = std::max(j_max, j);
+			}
+		}
+
+		if (all_behind)
+		{
+			return false;
+		}
+
+		// A box reaching behind the camera plane may cover any part of the image.
+		if (any_behind)
+		{
+			i0 = 0, j0 = 0, i1 = image_width - 1, j1 = image_height - 1;
+
+			return true;
+		}
+
+		// Samples are jittered within half a pixel of the pixel centers.
+		if (i_max < -1.0 || j_max < -1.0 || i_min > image_width || j_min > image_height)
+		{
+			return false;
+		}
+
+		i0 = static_cast<int>(std::max(std::floor(i_min - 0.5), 0.0));
+		j0 = static_cast<int>(std::max(std::floor(j_min - 0.5), 0.0));
+		i1 = static_cast<int>(std::min(std::ceil(i_max + 0.5), image_width - 1.0));
+		j1 = static_cast<int>(std::min(std::ceil(j_max + 0.5), image_height - 1.0));
+
+		return true;
+	}
+
+	template<class F>
+	void render_tile(const hittable& world, int tiles_x, int tile, int samples, F&& accumulate, tile_summary* summary = nullptr) const
+	{
+		// Takes "samples" more samples of every pixel of the tile, handing the sum of each pixel to
+		// "accumulate(i, j, pixel_color)". When given, "summary" records what the paths touched.
+		int i0 = (tile % tiles_x) * tile_size;
+		int j0 = (tile / tiles_x) * tile_size;
+		int i1 = std::min(i0 + tile_size, image_width);
+		int j1 = std::min(j0 + tile_size, image_height);
+
+		if (use_packets)
+		{
+			for (int bj = j0; bj < j1; bj += packet_width)
+			{
+				for (int bi = i0; bi < i1; bi += packet_width)
+				{
+					color pixel_colors[packet_size];
+					int bi1 = std::min(bi + packet_width, i1);
+					int bj1 = std::min(bj + packet_width, j1);
+
+					for (int sample = 0; sample < samples; ++sample)
+					{
+						sample_packet(world, bi, bj, bi1, bj1, pixel_colors, summary);
+					}
+
+					for (int j = bj; j < bj1; ++j)
+					{
+						for (int i = bi; i < bi1; ++i)
+						{
+							accumulate(i, j, pixel_colors[(j - bj) * packet_width + (i - bi)]);
+						}
+					}
+				}
+			}
+
+			return;
+		}
+
+		for (int j = j0; j < j1; ++j)
+		{
+			for (int i = i0; i < i1; ++i)
+			{
+				color pixel_color(0.0, 0.0, 0.0);
+
+				for (int sample = 0; sample < samples; ++sample)
+				{
+					ray r = get_ray(i, j);
+					pixel_color += get_ray_color(r, max_depth, world, summary);
+				}
+
+				accumulate(i, j, pixel_color);
+			}
+		}
+	}
+
+	void sample_packet(const hittable& world, int i0, int j0, int i1, int j1, color* pixel_colors, tile_summary* summary = nullptr) const
+	{
+		// Adds one sample to every pixel of the block [i0, i1) x [j0, j1), tracing its primary rays together
+		// as one packet. Only the first hit is traced as a packet, since bounced rays are no longer coherent.
+		ray_packet packet;
+
+		for (int j = j0; j < j1; ++j)
+		{
+			for (int i = i0; i < i1; ++i)
+			{
+				packet.set_ray((j - j0) * packet_width + (i - i0), get_ray(i, j));
+			}
+		}
+
+		packet.finalize();
+
+		packet_hit hits;
+		uint32_t hit_lanes = world.hit_packet(packet, packet.active, 0.001, hits);
+
+		for (int lane = 0; lane < packet_size; ++lane)
+		{
+			if (!(packet.active & (1u << lane)))
+			{
+				continue;
+			}
+
+			if (hit_lanes & (1u << lane))
+			{
+				if (hits.recs[lane].object)
+				{
+					hits.recs[lane].object->set_hit_attributes(packet.rays[lane], hits.recs[lane]);
+				}
+
+				pixel_colors[lane] += get_scattered_color(packet.rays[lane], hits.recs[lane], max_depth, world, summary);
+			}
+			else
+			{
+				pixel_colors[lane] += get_background_color(packet.rays[lane]);
+			}
+		}
+	}
+
 	ray get_ray(int i, int j) const
 	{
 		// Get a randomly sampled camera ray for the pixel at location (i, j), originating
@@ -171,8 +531,10 @@ private:
 		return center + (p[0] * defocus_disk_u) + (p[1] * defocus_disk_v);
 	}
 
-	color get_ray_color(const ray& r, int depth, const hittable& world) const
+	color get_ray_color(const ray& r, int depth, const hittable& world, tile_summary* summary = nullptr, double scattering_pdf = 0.0) const
 	{
+		// "scattering_pdf" is the density with which the previous bounce picked "r", or zero after camera
+		// rays, specular bounces, and when neither the environment nor the cache need it.
 		hit_record rec;
 
 		// If we've exceeded the ray bounce limit, no more light is gathered.
@@ -184,17 +546,133 @@ private:
 		// Using "0.001" as the minimum value to avoid shadow acne.
 		if (world.hit(r, interval(0.001, infinity), rec))
 		{
-			color attenuation;
-			ray scattered;
-
-			if (rec.mat->scatter(r, rec, attenuation, scattered))
+			if (rec.object)
 			{
-				return attenuation * get_ray_color(scattered, depth - 1, world);
+				rec.object->set_hit_attributes(r, rec);
 			}
 
+			return get_scattered_color(r, rec, depth, world, summary, scattering_pdf > 0.0);
+		}
+
+		if (environment && scattering_pdf > 0.0)
+		{
+			// This light was also reachable by sampling the environment at the previous bounce.
+			return power_heuristic(scattering_pdf, environment->pdf(r.get_direction())) * get_background_color(r);
+		}
+
+		return get_background_color(r);
+	}
+
+	color get_scattered_color(const ray& r, const hit_record& rec, int depth, const hittable& world, tile_summary* summary = nullptr, bool after_diffuse = false) const
+	{
+		// Lambertian radiance doesn't depend on the view direction, so past the first diffuse bounce it can
+		// be shared between paths through the cache.
+		bool cached = diffuse_cache && after_diffuse && rec.mat->get_kind() == material_kind::lambertian;
+		color radiance;
+
+		if (summary && max_depth - depth < summary_depth)
+		{
+			summary->add_point(rec.p, summary_cell_size);
+			summary->add_material(rec.mat);
+		}
+
+		if (cached && diffuse_cache->lookup(rec.p, rec.normal, radiance))
+		{
+			return radiance;
+		}
+
+		radiance = get_outgoing_color(r, rec, depth, world, summary);
+
+		if (cached)
+		{
+			diffuse_cache->add(rec.p, rec.normal, radiance);
+		}
+
+		return radiance;
+	}
+
+	color get_outgoing_color(const ray& r, const hit_record& rec, int depth, const hittable& world, tile_summary* summary) const
+	{
+		// Radiance leaving the hit point towards the origin of "r".
+		color attenuation;
+		ray scattered;
+
+		if (!scatter_material(*rec.mat, r, rec, attenuation, scattered))
+		{
+			return color(0.0, 0.0, 0.0);
+		}
+
+		if (!environment && !diffuse_cache)
+		{
+			return attenuation * get_ray_color(scattered, depth - 1, world, summary);
+		}
+
+		double pdf = scattering_pdf_material(*rec.mat, r, rec, scattered);
+		color direct(0.0, 0.0, 0.0);
+
+		// At the last bounce the scattered ray gathers nothing, so the environment sample is the only way
+		// to reach the light and takes its full weight.
+		bool last_bounce = depth - 1 <= 0;
+
+		if (environment && pdf > 0.0)
+		{
+			direct = get_environment_color(r, rec, attenuation, world, !last_bounce);
+		}
+
+		if (last_bounce)
+		{
+			return direct;
+		}
+
+		return direct + attenuation * get_ray_color(scattered, depth - 1, world, summary, pdf);
+	}
+
+	color get_environment_color(const ray& r, const hit_record& rec, const color& attenuation, const hittable& world, bool weighted = true) const
+	{
+		// Samples the environment directly from the hit point, weighted against the chance of reaching the
+		// same light by scattering (multiple importance sampling, power heuristic), unless "weighted" is
+		// false because no scattered ray follows.
+		double light_pdf;
+		ray to_light(rec.p, environment->sample(light_pdf));
+
+		if (light_pdf <= 0.0)
+		{
 			return color(0.0, 0.0, 0.0);
 		}
 
+		double pdf = scattering_pdf_material(*rec.mat, r, rec, to_light);
+
+		if (pdf <= 0.0)
+		{
+			return color(0.0, 0.0, 0.0);
+		}
+
+		hit_record occluder;
+
+		if (world.hit(to_light, interval(0.001, infinity), occluder))
+		{
+			return color(0.0, 0.0, 0.0);
+		}
+
+		// For a material whose scatter direction follows "scattering_pdf", its BSDF times cosine is the
+		// attenuation times that density.
+		double weight = weighted ? power_heuristic(light_pdf, pdf) : 1.0;
+
+		return (weight * pdf / light_pdf) * attenuation * environment->radiance(to_light.get_direction());
+	}
+
+	static double power_heuristic(double pdf, double other_pdf)
+	{
+		return (pdf * pdf) / (pdf * pdf + other_pdf * other_pdf);
+	}
+
+	color get_background_color(const ray& r) const
+	{
+		if (environment)
+		{
+			return environment->radiance(r.get_direction());
+		}
+
 		vec3 unit_direction = unit_vector(r.get_direction());
 		double a = 0.5 * (unit_direction.y() + 1.0);
 
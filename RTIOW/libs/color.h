@@ -46,3 +46,11 @@ void write_color_into_buffer(unsigned char* buffer, int stride, color pixel_colo
 	buffer[stride + 1] = static_cast<int>(256 * intensity.clamp(g));
 	buffer[stride + 2] = static_cast<int>(256 * intensity.clamp(b));
 }
+
+void write_color_into_float_buffer(float* buffer, int stride, color pixel_color)
+{
+	// Write the linear value of each color component, without gamma nor clamping.
+	buffer[stride + 0] = static_cast<float>(pixel_color.x());
+	buffer[stride + 1] = static_cast<float>(pixel_color.y());
+	buffer[stride + 2] = static_cast<float>(pixel_color.z());
+}
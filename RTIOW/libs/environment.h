@@ -0,0 +1,200 @@
+#pragma once
+
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+#include "common.h"
+
+#include "color.h"
+
+#include "external/stbi/stb_image.h"
+
+// Light arriving from infinitely far away in every direction, given by an equirectangular HDR image.
+// Directions are importance sampled from a 2D distribution over the texels, proportional to their
+// luminance times the solid angle they cover.
+class environment_light
+{
+public:
+	environment_light(const std::vector<float>& _pixels, int _width, int _height, double _intensity = 1.0)
+		: pixels(_pixels), width(_width), height(_height), intensity(_intensity)
+	{
+		build_distribution();
+	}
+
+	static std::shared_ptr<environment_light> load(const char* filename, double intensity = 1.0)
+	{
+		// Loads an equirectangular HDR image, such as a ".hdr" file. Returns null on failure.
+		int w, h, n;
+		float* data = stbi_loadf(filename, &w, &h, &n, 3);
+
+		if (!data)
+		{
+			std::clog << "Failed to load environment map \"" << filename << "\": " << stbi_failure_reason() << std::endl;
+
+			return nullptr;
+		}
+
+		std::vector<float> loaded(data, data + w * h * 3);
+		stbi_image_free(data);
+
+		return std::make_shared<environment_light>(loaded, w, h, intensity);
+	}
+
+	color radiance(const vec3& direction) const
+	{
+		int texel = texel_index(direction);
+
+		return intensity * color(pixels[texel * 3 + 0], pixels[texel * 3 + 1], pixels[texel * 3 + 2]);
+	}
+
+	vec3 sample(double& pdf) const
+	{
+		// Returns a random unit direction, along with its density over solid angle.
+		double u1 = random_double();
+		double u2 = random_double();
+
+		int row = static_cast<int>(std::upper_bound(marginal_cdf.begin(), marginal_cdf.end(), u1) - marginal_cdf.begin());
+		row = std::min(row, height - 1);
+
+		const double* row_cdf = &conditional_cdf[row * width];
+		int column = static_cast<int>(std::upper_bound(row_cdf, row_cdf + width, u2) - row_cdf);
+		column = std::min(column, width - 1);
+
+		// Jitter within the texel, so that sampled directions cover the whole sphere.
+		double u = (column + random_double()) / width;
+		double v = (row + random_double()) / height;
+		vec3 direction = direction_from_uv(u, v);
+
+		pdf = texel_pdf(row, column, v);
+
+		return direction;
+	}
+
+	double pdf(const vec3& direction) const
+	{
+		// Density over solid angle with which "sample" returns "direction".
+		vec3 unit_direction = unit_vector(direction);
+		int row, column;
+		double v;
+
+		texel_coordinates(unit_direction, row, column, v);
+
+		return texel_pdf(row, column, v);
+	}
+
+private:
+	std::vector<float> pixels; // Linear RGB texels, top row first.
+	int width, height;
+	double intensity; // Scale applied to the texels.
+	std::vector<double> marginal_cdf; // Cumulative distribution of the rows.
+	std::vector<double> conditional_cdf; // Cumulative distribution of the columns, within each row.
+	std::vector<double> texel_probability; // Probability of picking each texel.
+
+	void build_distribution()
+	{
+		int num_texels = width * height;
+		double total = 0.0;
+
+		texel_probability.assign(num_texels, 0.0);
+		marginal_cdf.assign(height, 0.0);
+		conditional_cdf.assign(num_texels, 0.0);
+
+		for (int row = 0; row < height; ++row)
+		{
+			// Texels shrink towards the poles, by the sine of their polar angle.
+			double sin_theta = std::sin(pi * (row + 0.5) / height);
+
+			for (int column = 0; column < width; ++column)
+			{
+				int texel = row * width + column;
+				double luminance = 0.2126 * pixels[texel * 3 + 0] + 0.7152 * pixels[texel * 3 + 1] + 0.0722 * pixels[texel * 3 + 2];
+
+				texel_probability[texel] = std::max(luminance, 0.0) * sin_theta;
+				total += texel_probability[texel];
+			}
+		}
+
+		// A black map falls back to picking texels by solid angle alone.
+		if (total <= 0.0)
+		{
+			for (int texel = 0; texel < num_texels; ++texel)
+			{
+				texel_probability[texel] = std::sin(pi * (texel / width + 0.5) / height);
+				total += texel_probability[texel];
+			}
+		}
+
+		for (double& p : texel_probability)
+		{
+			p /= total;
+		}
+
+		double marginal_sum = 0.0;
+
+		for (int row = 0; row < height; ++row)
+		{
+			double row_sum = 0.0;
+
+			for (int column = 0; column < width; ++column)
+			{
+				row_sum += texel_probability[row * width + column];
+			}
+
+			double conditional_sum = 0.0;
+
+			for (int column = 0; column < width; ++column)
+			{
+				conditional_sum += texel_probability[row * width + column];
+				conditional_cdf[row * width + column] = row_sum > 0.0 ? conditional_sum / row_sum : (column + 1.0) / width;
+			}
+
+			marginal_sum += row_sum;
+			marginal_cdf[row] = marginal_sum;
+		}
+	}
+
+	double texel_pdf(int row, int column, double v) const
+	{
+		// Converts the texel probability into a density over solid angle: a texel covers a solid angle of
+		// (2 pi / width) * (pi / height) * sin(theta).
+		double sin_theta = std::sin(pi * v);
+
+		if (sin_theta <= 0.0)
+		{
+			return 0.0;
+		}
+
+		return texel_probability[row * width + column] * width * height / (2.0 * pi * pi * sin_theta);
+	}
+
+	static vec3 direction_from_uv(double u, double v)
+	{
+		double phi = 2.0 * pi * u - pi;
+		double theta = pi * v;
+
+		return vec3(std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi));
+	}
+
+	void texel_coordinates(const vec3& unit_direction, int& row, int& column, double& v) const
+	{
+		double theta = std::acos(std::max(-1.0, std::min(1.0, unit_direction.y())));
+		double phi = std::atan2(unit_direction.z(), unit_direction.x());
+
+		double u = (phi + pi) / (2.0 * pi);
+		v = theta / pi;
+
+		column = std::min(static_cast<int>(u * width), width - 1);
+		row = std::min(static_cast<int>(v * height), height - 1);
+	}
+
+	int texel_index(const vec3& direction) const
+	{
+		int row, column;
+		double v;
+
+		texel_coordinates(unit_vector(direction), row, column, v);
+
+		return row * width + column;
+	}
+};
@@ -2,15 +2,25 @@
 
 #include "common.h"
 
+#include "aabb.h"
+#include "ray_packet.h"
+
 class material;
 
+class hittable;
+
 class hit_record
 {
 public:
+	// Assigned by every intersection test that accepts a hit, since the record is shared by all candidates
+	// and may still hold an earlier, farther one.
+	double t;
+	const hittable* object = nullptr; // Primitive that was hit, or null when the test filled the attributes below itself.
+
+	// Filled once, for the closest hit only, by "object->set_hit_attributes".
 	point3 p;
 	vec3 normal;
-	std::shared_ptr<material> mat;
-	double t;
+	const material* mat = nullptr;
 	bool front_face;
 
 	void set_face_normal(const ray& r, const vec3& outward_normal)
@@ -23,10 +33,55 @@ public:
 	}
 };
 
+class packet_hit
+{
+public:
+	hit_record recs[packet_size]; // Closest hit of each lane.
+	double t_max[packet_size]; // Distance to the closest hit of each lane, so far.
+
+	packet_hit()
+	{
+		for (int lane = 0; lane < packet_size; ++lane)
+		{
+			t_max[lane] = infinity;
+		}
+	}
+};
+
 class hittable
 {
 public:
 	virtual ~hittable() = default;
 
+	// Finds the closest hit within "ray_ti", recording only its distance and primitive. Records are only
+	// written when a hit is accepted, so callers can pass the same record down to every candidate. A test
+	// accepting a hit must always assign "rec.object": to itself, so that "set_hit_attributes" is called
+	// later, or to null if it filled the point, normal and material already. Otherwise the primitive of
+	// an earlier candidate would overwrite them.
 	virtual bool hit(const ray& r, interval ray_ti, hit_record& rec) const = 0;
+
+	virtual void set_hit_attributes(const ray& r, hit_record& rec) const
+	{
+		// Fills the point, normal and material of a hit on this primitive, found by "hit".
+	}
+
+	virtual aabb bounding_box() const = 0;
+
+	virtual uint32_t hit_packet(const ray_packet& packet, uint32_t mask, double ray_tmin, packet_hit& hits) const
+	{
+		// Returns the lanes of "mask" that hit the object closer than their current closest hit.
+		// By default, each lane is traced as a single ray.
+		uint32_t hit_lanes = 0;
+
+		for (int lane = 0; lane < packet_size; ++lane)
+		{
+			if ((mask & (1u << lane)) && hit(packet.rays[lane], interval(ray_tmin, hits.t_max[lane]), hits.recs[lane]))
+			{
+				hits.t_max[lane] = hits.recs[lane].t;
+				hit_lanes |= 1u << lane;
+			}
+		}
+
+		return hit_lanes;
+	}
 };
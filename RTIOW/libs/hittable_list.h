@@ -18,29 +18,49 @@ public:
 	void clear()
 	{
 		objects.clear();
+		bbox = aabb();
 	}
 
 	void add(std::shared_ptr<hittable> object)
 	{
 		objects.push_back(object);
+		bbox = aabb(bbox, object->bounding_box());
 	}
 
 	bool hit(const ray& r, interval ray_ti, hit_record& rec) const override
 	{
-		hit_record temp_rec;
 		bool hit_anything = false;
 		double closest_so_far = ray_ti.max;
 
 		for (const auto& object : objects)
 		{
-			if (object->hit(r, interval(ray_ti.min, closest_so_far), temp_rec))
+			if (object->hit(r, interval(ray_ti.min, closest_so_far), rec))
 			{
 				hit_anything = true;
-				closest_so_far = temp_rec.t;
-				rec = temp_rec;
+				closest_so_far = rec.t;
 			}
 		}
 
 		return hit_anything;
 	}
+
+	aabb bounding_box() const override
+	{
+		return bbox;
+	}
+
+	uint32_t hit_packet(const ray_packet& packet, uint32_t mask, double ray_tmin, packet_hit& hits) const override
+	{
+		uint32_t hit_lanes = 0;
+
+		for (const auto& object : objects)
+		{
+			hit_lanes |= object->hit_packet(packet, mask, ray_tmin, hits);
+		}
+
+		return hit_lanes;
+	}
+
+private:
+	aabb bbox;
 };
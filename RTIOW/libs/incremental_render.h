@@ -0,0 +1,196 @@
+#pragma once
+
+#include <vector>
+
+#include "common.h"
+
+#include "aabb.h"
+#include "camera.h"
+#include "color.h"
+#include "hittable.h"
+#include "material.h"
+#include "post_process.h"
+#include "render_session.h"
+#include "thread_pool.h"
+#include "tile_summary.h"
+
+class scene_edit
+{
+public:
+	std::vector<aabb> regions; // World-space boxes whose contents changed, e.g. the old and the new bounds of a moved object.
+	std::vector<const material*> materials; // Materials whose parameters changed in place.
+};
+
+// Keeps the float framebuffer of a frame, along with a summary of what the paths of each tile touched, so
+// that after a scene edit only the tiles that may see the change are rendered again.
+class incremental_render
+{
+public:
+	double region_margin = 0.5; // Distance around edited regions within which path vertices are affected, to catch shadows and contact lighting.
+
+	incremental_render(const camera& _cam, thread_pool& _pool) : cam(_cam), pool(_pool), image_width(0), image_height(0)
+	{
+		// The diffuse cache would hand stale radiance to the tiles rendered after an edit, and paths that
+		// stop at a cache hit leave their later vertices out of the summaries, so it is not used here.
+		cam.diffuse_cache = nullptr;
+	}
+
+	void render(const hittable& world)
+	{
+		// Renders the whole frame, recording the summaries of every tile.
+		render_session session(cam, world, pool);
+
+		image_width = session.get_image_width();
+		image_height = session.get_image_height();
+		pixels.assign(image_width * image_height * 3, 0.0f);
+		summaries.assign(session.get_tile_count(), tile_summary());
+
+		session.set_output(pixels.data());
+		session.set_tile_summaries(summaries.data());
+		session.start();
+		session.wait();
+	}
+
+	int rerender(const hittable& world, const scene_edit& edit)
+	{
+		// Renders again the tiles affected by the edit of "world", returning how many there were.
+		if (summaries.empty())
+		{
+			render(world);
+
+			return static_cast<int>(summaries.size());
+		}
+
+		std::vector<int> tiles = affected_tiles(edit);
+
+		if (!tiles.empty())
+		{
+			render_session session(cam, world, pool);
+
+			session.set_output(pixels.data());
+			session.set_tile_summaries(summaries.data());
+			session.set_tiles(tiles);
+			session.start();
+			session.wait();
+		}
+
+		return static_cast<int>(tiles.size());
+	}
+
+	const std::vector<float>& get_pixels() const
+	{
+		// Linear radiance, 3 floats per pixel.
+		return pixels;
+	}
+
+	bool write(const char* output_filename) const
+	{
+		// The format follows the extension of "output_filename", as in "post_process::add_output".
+		post_process post(pool);
+		post.transfer = transfer_function::gamma_2; // Square root, as in the book.
+		post.add_output(output_filename);
+
+		return post.write(pixels.data(), image_width, image_height);
+	}
+
+private:
+	static const int max_region_cells = 4096; // Beyond this count of cells, an edited region affects every tile.
+
+	camera cam;
+	thread_pool& pool;
+	int image_width, image_height;
+	std::vector<float> pixels;
+	std::vector<tile_summary> summaries;
+
+	std::vector<int> affected_tiles(const scene_edit& edit) const
+	{
+		// Summaries only hold the vertices paths hit, so an object moved into empty space or in front of
+		// the sky is caught by where the region projects on screen instead. Indirect views of such space,
+		// through mirrors or on shadow receivers farther than the margin, are not caught.
+		std::vector<uint64_t> keys;
+		std::vector<bool> covered(summaries.size(), false);
+		bool affects_all = false;
+		camera view = cam;
+
+		view.initialize();
+
+		int tiles_x = (image_width + view.tile_size - 1) / view.tile_size;
+
+		for (const aabb& region : edit.regions)
+		{
+			double num_cells = 1.0;
+
+			for (int axis = 0; axis < 3; axis++)
+			{
+				const interval& ax = region.axis_interval(axis);
+
+				num_cells *= std::floor((ax.max + region_margin) / cam.summary_cell_size) - std::floor((ax.min - region_margin) / cam.summary_cell_size) + 1.0;
+			}
+
+			// Also catches unbounded regions, whose cell count is not finite.
+			if (!(num_cells <= max_region_cells))
+			{
+				affects_all = true;
+				break;
+			}
+
+			int i0, j0, i1, j1;
+
+			if (view.get_screen_bounds(aabb(region.x.expand(2.0 * region_margin), region.y.expand(2.0 * region_margin), region.z.expand(2.0 * region_margin)), i0, j0, i1, j1))
+			{
+				for (int ty = j0 / view.tile_size; ty <= j1 / view.tile_size; ++ty)
+				{
+					for (int tx = i0 / view.tile_size; tx <= i1 / view.tile_size; ++tx)
+					{
+						covered[ty * tiles_x + tx] = true;
+					}
+				}
+			}
+
+			int64_t lo[3], hi[3];
+
+			for (int axis = 0; axis < 3; axis++)
+			{
+				const interval& ax = region.axis_interval(axis);
+
+				lo[axis] = tile_summary::cell_index(ax.min - region_margin, cam.summary_cell_size);
+				hi[axis] = tile_summary::cell_index(ax.max + region_margin, cam.summary_cell_size);
+			}
+
+			for (int64_t x = lo[0]; x <= hi[0]; ++x)
+			{
+				for (int64_t y = lo[1]; y <= hi[1]; ++y)
+				{
+					for (int64_t z = lo[2]; z <= hi[2]; ++z)
+					{
+						keys.push_back(tile_summary::cell_key(x, y, z));
+					}
+				}
+			}
+		}
+
+		for (const material* mat : edit.materials)
+		{
+			keys.push_back(tile_summary::material_key(mat));
+		}
+
+		std::vector<int> tiles;
+
+		for (int tile = 0; tile < static_cast<int>(summaries.size()); ++tile)
+		{
+			bool affected = affects_all || covered[tile];
+
+			for (size_t k = 0; k < keys.size() && !affected; ++k)
+			{
+				affected = summaries[tile].contains_key(keys[k]);
+			}
+
+			if (affected)
+			{
+				tiles.push_back(tile);
+			}
+		}
+
+		return tiles;
+	}
+};
@@ -9,6 +9,13 @@ public:
 
 	interval(double _min, double _max) : min(_min), max(_max) {}
 
+	interval(const interval& a, const interval& b) : min(std::fmin(a.min, b.min)), max(std::fmax(a.max, b.max)) {} // Tightly encloses both intervals.
+
+	double size() const
+	{
+		return max - min;
+	}
+
 	bool contains(double x) const
 	{
 		return min <= x && x <= max;
@@ -27,6 +34,13 @@ public:
 		return x;
 	}
 
+	interval expand(double delta) const
+	{
+		double padding = delta / 2.0;
+
+		return interval(min - padding, max + padding);
+	}
+
 	static const interval empty, universe;
 };
 
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Read-only view of a range of a file, mapped into memory. The pages are read from disk on first touch
+// and may be dropped by the system under memory pressure; the view is unmapped when destroyed.
+class mapped_region
+{
+public:
+	mapped_region(void* _base, size_t _mapped_size, size_t _offset, size_t _size) : base(_base), mapped_size(_mapped_size), offset(_offset), length(_size) {}
+
+	~mapped_region()
+	{
+#ifdef _WIN32
+		UnmapViewOfFile(base);
+#else
+		munmap(base, mapped_size);
+#endif
+	}
+
+	mapped_region(const mapped_region&) = delete;
+	mapped_region& operator=(const mapped_region&) = delete;
+
+	const unsigned char* data() const { return static_cast<const unsigned char*>(base) + offset; }
+	size_t size() const { return length; }
+
+private:
+	void* base; // Start of the mapping, aligned down to the mapping granularity.
+	size_t mapped_size;
+	size_t offset; // Of the requested range, from "base".
+	size_t length;
+};
+
+class mapped_file
+{
+public:
+	mapped_file(const std::string& filename) : file_size(0)
+	{
+#ifdef _WIN32
+		mapping = nullptr;
+		file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+		LARGE_INTEGER size;
+
+		if (file != INVALID_HANDLE_VALUE && GetFileSizeEx(file, &size) && size.QuadPart > 0)
+		{
+			file_size = static_cast<uint64_t>(size.QuadPart);
+			mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		}
+
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		granularity = info.dwAllocationGranularity;
+#else
+		descriptor = open(filename.c_str(), O_RDONLY);
+
+		struct stat status;
+
+		if (descriptor >= 0 && fstat(descriptor, &status) == 0)
+		{
+			file_size = static_cast<uint64_t>(status.st_size);
+		}
+
+		granularity = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+#endif
+	}
+
+	~mapped_file()
+	{
+#ifdef _WIN32
+		if (mapping) { CloseHandle(mapping); }
+		if (file != INVALID_HANDLE_VALUE) { CloseHandle(file); }
+#else
+		if (descriptor >= 0) { close(descriptor); }
+#endif
+	}
+
+	mapped_file(const mapped_file&) = delete;
+	mapped_file& operator=(const mapped_file&) = delete;
+
+	bool is_open() const
+	{
+#ifdef _WIN32
+		return mapping != nullptr;
+#else
+		return descriptor >= 0 && file_size > 0;
+#endif
+	}
+
+	uint64_t size() const { return file_size; }
+
+	std::shared_ptr<mapped_region> map(uint64_t offset, size_t size) const
+	{
+		// Maps the "size" bytes at "offset", or returns null if they are not all in the file.
+		if (!is_open() || size == 0 || offset + size > file_size)
+		{
+			return nullptr;
+		}
+
+		uint64_t aligned_offset = offset - offset % granularity;
+		size_t mapped_size = static_cast<size_t>(offset - aligned_offset) + size;
+
+#ifdef _WIN32
+		void* base = MapViewOfFile(mapping, FILE_MAP_READ, static_cast<DWORD>(aligned_offset >> 32), static_cast<DWORD>(aligned_offset & 0xFFFFFFFFull), mapped_size);
+
+		if (!base)
+		{
+			return nullptr;
+		}
+#else
+		void* base = mmap(nullptr, mapped_size, PROT_READ, MAP_PRIVATE, descriptor, static_cast<off_t>(aligned_offset));
+
+		if (base == MAP_FAILED)
+		{
+			return nullptr;
+		}
+#endif
+
+		return std::make_shared<mapped_region>(base, mapped_size, static_cast<size_t>(offset - aligned_offset), size);
+	}
+
+private:
+#ifdef _WIN32
+	HANDLE file, mapping;
+#else
+	int descriptor;
+#endif
+	uint64_t file_size;
+	uint64_t granularity; // Mappings must start at multiples of it.
+};
@@ -6,18 +6,34 @@
 
 class hit_record;
 
+enum class material_kind { lambertian, metal, dielectric, other };
+
 class material
 {
 public:
+	material(material_kind _kind = material_kind::other) : kind(_kind) {}
+
 	virtual ~material() = default;
 
 	virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const = 0;
+
+	virtual double scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const
+	{
+		// Density, over solid angle, with which "scatter" picks the direction of "scattered". Zero for
+		// materials that can't be sampled towards an arbitrary direction, such as mirrors and glass.
+		return 0.0;
+	}
+
+	material_kind get_kind() const { return kind; }
+
+private:
+	material_kind kind; // Tag of the built-in materials, for dispatching without virtual calls.
 };
 
-class lambertian : public material
+class lambertian final : public material
 {
 public:
-	lambertian(const color& _albedo) : albedo(_albedo) {}
+	lambertian(const color& _albedo) : material(material_kind::lambertian), albedo(_albedo) {}
 
 	bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const override
 	{
@@ -35,14 +51,22 @@ public:
 		return true;
 	}
 
+	double scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const override
+	{
+		// The scatter direction above is cosine distributed around the normal.
+		double cos_theta = dot(rec.normal, unit_vector(scattered.get_direction()));
+
+		return cos_theta < 0.0 ? 0.0 : cos_theta / pi;
+	}
+
 private:
 	color albedo;
 };
 
-class metal : public material
+class metal final : public material
 {
 public:
-	metal(const color& _albedo, double _fuzz) : albedo(_albedo), fuzz(std::min(_fuzz, 1.0)) {}
+	metal(const color& _albedo, double _fuzz) : material(material_kind::metal), albedo(_albedo), fuzz(std::min(_fuzz, 1.0)) {}
 
 	bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const override
 	{
@@ -60,10 +84,10 @@ private:
 	double fuzz;
 };
 
-class dielectric : public material
+class dielectric final : public material
 {
 public:
-	dielectric(double _refraction_index) : refraction_index(_refraction_index) {}
+	dielectric(double _refraction_index) : material(material_kind::dielectric), refraction_index(_refraction_index) {}
 
 	bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const override
 	{
@@ -105,3 +129,35 @@ private:
 		return r0 + (1 - r0) * std::pow((1 - cosine), 5);
 	}
 };
+
+inline bool scatter_material(const material& mat, const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered)
+{
+	// Switch on the material kind, so the built-in materials are called directly (their classes are final)
+	// and can be inlined. Any other material goes through the virtual call.
+	switch (mat.get_kind())
+	{
+	case material_kind::lambertian:
+		return static_cast<const lambertian&>(mat).scatter(r_in, rec, attenuation, scattered);
+	case material_kind::metal:
+		return static_cast<const metal&>(mat).scatter(r_in, rec, attenuation, scattered);
+	case material_kind::dielectric:
+		return static_cast<const dielectric&>(mat).scatter(r_in, rec, attenuation, scattered);
+	default:
+		return mat.scatter(r_in, rec, attenuation, scattered);
+	}
+}
+
+inline double scattering_pdf_material(const material& mat, const ray& r_in, const hit_record& rec, const ray& scattered)
+{
+	// Only lambertian has a density among the built-in materials, so the others skip the virtual call.
+	switch (mat.get_kind())
+	{
+	case material_kind::lambertian:
+		return static_cast<const lambertian&>(mat).scattering_pdf(r_in, rec, scattered);
+	case material_kind::metal:
+	case material_kind::dielectric:
+		return 0.0;
+	default:
+		return mat.scattering_pdf(r_in, rec, scattered);
+	}
+}
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+#include "camera.h"
+#include "hittable.h"
+#include "post_process.h"
+#include "render_session.h"
+#include "thread_pool.h"
+
+class view
+{
+public:
+	camera cam;
+	std::string output_filename; // Format from the extension: ".jpg", ".png" or ".hdr".
+};
+
+// Renders several views of the same scene in one go: the scene is built once by the caller, and the tiles
+// of every view are queued on one pool together, so workers never idle between views.
+class multi_view_job
+{
+public:
+	std::vector<view> views;
+
+	void add_view(const camera& cam, const std::string& output_filename)
+	{
+		views.push_back(view{ cam, output_filename });
+	}
+
+	void render(const hittable& world, thread_pool& pool)
+	{
+		std::vector<std::unique_ptr<render_session>> sessions;
+		std::vector<std::vector<float>> buffers(views.size());
+
+		for (size_t v = 0; v < views.size(); ++v)
+		{
+			sessions.emplace_back(new render_session(views[v].cam, world, pool));
+			buffers[v].resize(sessions[v]->get_image_width() * sessions[v]->get_image_height() * 3);
+			sessions[v]->set_output(buffers[v].data());
+		}
+
+		for (auto& session : sessions)
+		{
+			session->start();
+		}
+
+		// Views finish in queue order, and each one is encoded here on the calling thread rather than on the
+		// pool, where it would queue behind the tiles of every later view. So it is written while the next
+		// ones are still rendering.
+		for (size_t v = 0; v < views.size(); ++v)
+		{
+			sessions[v]->wait();
+
+			std::clog << '\r' << "Views done: " << (v + 1) << "/" << views.size() << "        " << std::flush;
+
+			// Encoded with the square root, as the other renders are.
+			post_process post;
+
+			post.transfer = transfer_function::gamma_2;
+			post.add_output(views[v].output_filename);
+			post.write(buffers[v].data(), sessions[v]->get_image_width(), sessions[v]->get_image_height());
+		}
+
+		std::clog << '\n' << "Done!" << std::endl;
+	}
+};
+
+inline std::vector<camera> stereo_cameras(const camera& base, double eye_separation)
+{
+	// Left and right eye cameras, offset along the camera horizontal axis and looking in parallel.
+	vec3 w = unit_vector(base.lookfrom - base.lookat);
+	vec3 u = unit_vector(cross(base.vup, w));
+	vec3 offset = 0.5 * eye_separation * u;
+
+	std::vector<camera> cameras(2, base);
+
+	cameras[0].lookfrom = base.lookfrom - offset;
+	cameras[0].lookat = base.lookat - offset;
+	cameras[1].lookfrom = base.lookfrom + offset;
+	cameras[1].lookat = base.lookat + offset;
+
+	return cameras;
+}
+
+inline std::vector<camera> cubemap_cameras(const camera& base)
+{
+	// Six square, 90 degree cameras at "base.lookfrom", in the +X, -X, +Y, -Y, +Z, -Z face order.
+	static const vec3 directions[6] = { vec3(1, 0, 0), vec3(-1, 0, 0), vec3(0, 1, 0), vec3(0, -1, 0), vec3(0, 0, 1), vec3(0, 0, -1) };
+	static const vec3 ups[6] = { vec3(0, -1, 0), vec3(0, -1, 0), vec3(0, 0, 1), vec3(0, 0, -1), vec3(0, -1, 0), vec3(0, -1, 0) };
+
+	std::vector<camera> cameras(6, base);
+
+	for (int face = 0; face < 6; ++face)
+	{
+		cameras[face].aspect_ratio = 1.0;
+		cameras[face].vfov = 90.0;
+		cameras[face].defocus_angle = 0.0;
+		cameras[face].lookat = base.lookfrom + directions[face];
+		cameras[face].vup = ups[face];
+	}
+
+	return cameras;
+}
+
+inline std::vector<camera> turntable_cameras(const camera& base, int count)
+{
+	// "count" cameras evenly spaced on the circle around "base.lookat", about the "base.vup" axis.
+	vec3 axis = unit_vector(base.vup);
+	vec3 offset = base.lookfrom - base.lookat;
+
+	std::vector<camera> cameras(count, base);
+
+	for (int k = 0; k < count; ++k)
+	{
+		// Rodrigues' rotation of the offset about the axis.
+		double angle = 2.0 * pi * k / count;
+		vec3 rotated = std::cos(angle) * offset + std::sin(angle) * cross(axis, offset) + (1.0 - std::cos(angle)) * dot(axis, offset) * axis;
+
+		cameras[k].lookfrom = base.lookat + rotated;
+	}
+
+	return cameras;
+}
@@ -0,0 +1,429 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <condition_variable>
+
+#include "common.h"
+
+#include "thread_pool.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define POST_PROCESS_SSE2
+#include <emmintrin.h>
+#endif
+
+// The implementations are compiled where the STB_*_IMPLEMENTATION macros are defined, which may already
+// have happened through another header of this translation unit.
+#ifndef INCLUDE_STB_IMAGE_WRITE_H
+#include "external/stbi/stb_image_write.h"
+#endif
+#ifndef STBIR_INCLUDE_STB_IMAGE_RESIZE2_H
+#include "external/stbi/stb_image_resize2.h"
+#endif
+
+enum class tone_curve
+{
+	clamp, // Values above 1 are clipped, as in the book.
+	reinhard, // x / (1 + x), compressing highlights smoothly.
+	filmic // Narkowicz's fit of the ACES curve, with a slight toe and shoulder.
+};
+
+enum class transfer_function
+{
+	gamma_2, // Square root, as in the book.
+	srgb // IEC 61966-2-1.
+};
+
+class post_output
+{
+public:
+	std::string filename; // Format from the extension: ".jpg", ".png" or ".hdr".
+	int width = 0; // Downsampled width, keeping the aspect ratio, or 0 for full size.
+	int quality = 100; // JPEG quality, in [1, 100].
+};
+
+// Turns one accumulated linear framebuffer into any number of image files, on a thread pool or on the
+// calling thread: exposure, tone curve, output encoding and optional dithering for the 8-bit formats,
+// downsampling for thumbnails. HDR files get the exposed radiance, without tone curve or encoding.
+// Full-size 8-bit outputs are tone-mapped and encoded row by row in one pass, four values at a time
+// with SSE2 where available.
+class post_process
+{
+public:
+	double exposure = 0.0; // In stops: radiance is scaled by 2 ^ exposure.
+	tone_curve curve = tone_curve::clamp;
+	transfer_function transfer = transfer_function::srgb;
+	bool dither = false; // Add ordered dither before quantizing to 8 bits, breaking up banding in smooth gradients.
+
+	post_process() : pool(nullptr) {} // Runs every stage on the calling thread.
+	post_process(thread_pool& _pool) : pool(&_pool) {}
+
+	void add_output(const std::string& filename, int width = 0, int quality = 100)
+	{
+		outputs.push_back(post_output{ filename, width, quality });
+	}
+
+	static bool is_supported(const std::string& filename)
+	{
+		// Whether "filename" has one of the extensions "write" knows how to encode.
+		return get_file_type(filename) != file_type::unknown;
+	}
+
+	bool write(const float* pixels, int width, int height)
+	{
+		// "pixels" holds linear radiance, 3 floats per pixel, "width * height * 3" floats in total, as
+		// produced by "render_session::set_output(float*)". Returns whether every file was written.
+		std::vector<image> images(outputs.size());
+		bool any_hdr = false;
+
+		for (size_t n = 0; n < outputs.size(); ++n)
+		{
+			images[n].type = get_file_type(outputs[n].filename);
+			images[n].width = outputs[n].width > 0 ? outputs[n].width : width;
+			images[n].height = outputs[n].width > 0 ? std::max(static_cast<int>(static_cast<double>(height) * outputs[n].width / width + 0.5), 1) : height;
+
+			any_hdr = any_hdr || images[n].type == file_type::hdr;
+		}
+
+		// Exposure and tone curve over the full framebuffer, only for the outputs that are resampled:
+		// full-size 8-bit outputs apply them row by row while encoding.
+		bool any_resized = false;
+
+		for (const image& img : images)
+		{
+			any_resized = any_resized || (img.type != file_type::hdr && (img.width != width || img.height != height));
+		}
+
+		std::vector<float> mapped(any_resized ? width * height * 3 : 0), exposed(any_hdr ? width * height * 3 : 0);
+		float scale = static_cast<float>(std::pow(2.0, exposure));
+
+		run_bands(any_resized || any_hdr ? height : 0, [&](int j0, int j1) {
+			size_t begin = static_cast<size_t>(j0) * width * 3, end = static_cast<size_t>(j1) * width * 3;
+
+			if (any_resized)
+			{
+				apply_tone_curve(pixels + begin, mapped.data() + begin, end - begin, scale);
+			}
+
+			if (any_hdr)
+			{
+				for (size_t k = begin; k < end; ++k)
+				{
+					exposed[k] = scale * pixels[k];
+				}
+			}
+		});
+
+		// Thumbnails, downsampled from the tone-mapped (or exposed) linear values, one output per task.
+		std::vector<std::function<void()>> tasks;
+
+		for (size_t n = 0; n < outputs.size(); ++n)
+		{
+			image& img = images[n];
+			const std::vector<float>& source = img.type == file_type::hdr ? exposed : mapped;
+
+			if (img.width == width && img.height == height)
+			{
+				img.linear = img.type == file_type::hdr ? exposed.data() : pixels;
+				img.tone_mapped = img.type == file_type::hdr;
+				continue;
+			}
+
+			tasks.push_back([&img, &source, width, height] {
+				img.resized.resize(img.width * img.height * 3);
+				stbir_resize_float_linear(source.data(), width, height, 0, img.resized.data(), img.width, img.height, 0, STBIR_RGB);
+				img.linear = img.resized.data();
+				img.tone_mapped = true;
+			});
+		}
+
+		run_tasks(tasks);
+
+		// Encoding of the 8-bit outputs, by bands of rows of all of them at once.
+		tasks.clear();
+
+		for (image& img : images)
+		{
+			if (img.type == file_type::jpg || img.type == file_type::png)
+			{
+				img.bytes.resize(img.width * img.height * 3);
+
+				for (int j0 = 0; j0 < img.height; j0 += band_rows)
+				{
+					tasks.push_back([this, &img, j0, scale] { encode(img, j0, std::min(j0 + band_rows, img.height), scale); });
+				}
+			}
+		}
+
+		run_tasks(tasks);
+
+		// Files, one per task.
+		std::vector<int> written(outputs.size(), 0);
+
+		tasks.clear();
+
+		for (size_t n = 0; n < outputs.size(); ++n)
+		{
+			tasks.push_back([this, &images, &written, n] {
+				const image& img = images[n];
+				const char* filename = outputs[n].filename.c_str();
+
+				switch (img.type)
+				{
+				case file_type::jpg: written[n] = stbi_write_jpg(filename, img.width, img.height, 3, img.bytes.data(), outputs[n].quality); break;
+				case file_type::png: written[n] = stbi_write_png(filename, img.width, img.height, 3, img.bytes.data(), img.width * 3); break;
+				case file_type::hdr: written[n] = stbi_write_hdr(filename, img.width, img.height, 3, img.linear); break;
+				default: break;
+				}
+			});
+		}
+
+		run_tasks(tasks);
+
+		bool success = true;
+
+		for (size_t n = 0; n < outputs.size(); ++n)
+		{
+			if (!written[n])
+			{
+				std::clog << '\n' << "Failed to write \"" << outputs[n].filename << "\"." << std::endl;
+				success = false;
+			}
+		}
+
+		return success;
+	}
+
+private:
+	enum class file_type { unknown, jpg, png, hdr };
+
+	class image
+	{
+	public:
+		file_type type = file_type::unknown;
+		int width = 0, height = 0;
+		const float* linear = nullptr; // Values to encode for the 8-bit formats, exposed radiance for HDR.
+		bool tone_mapped = false; // Whether "linear" went through exposure and the tone curve already.
+		std::vector<float> resized;
+		std::vector<unsigned char> bytes;
+	};
+
+	static const int band_rows = 16; // Rows per task of the per-pixel stages.
+	static const int pattern_size = 48; // Values per repeat of the dither offsets: 8 pixels of 3 channels, times 2 so that 16 values make whole SSE2 stores.
+
+	thread_pool* pool; // Null to run on the calling thread.
+	std::vector<post_output> outputs;
+
+	void apply_tone_curve(const float* in, float* out, size_t count, float scale) const
+	{
+		// One loop per curve, so the curve isn't picked again for every value.
+		switch (curve)
+		{
+		case tone_curve::clamp:
+			for (size_t k = 0; k < count; ++k)
+			{
+				out[k] = std::min(std::max(scale * in[k], 0.0f), 1.0f);
+			}
+			break;
+
+		case tone_curve::reinhard:
+			for (size_t k = 0; k < count; ++k)
+			{
+				float x = std::max(scale * in[k], 0.0f);
+				out[k] = x / (1.0f + x);
+			}
+			break;
+
+		case tone_curve::filmic:
+			for (size_t k = 0; k < count; ++k)
+			{
+				float x = std::max(scale * in[k], 0.0f);
+				out[k] = std::min((x * (2.51f * x + 0.03f)) / (x * (2.43f * x + 0.59f) + 0.14f), 1.0f);
+			}
+			break;
+		}
+	}
+
+	void encode(image& img, int j0, int j1, float scale) const
+	{
+		// 8x8 Bayer matrix, in 64ths of one 8-bit step.
+		static const int bayer[8][8] = {
+			{  0, 32,  8, 40,  2, 34, 10, 42 },
+			{ 48, 16, 56, 24, 50, 18, 58, 26 },
+			{ 12, 44,  4, 36, 14, 46,  6, 38 },
+			{ 60, 28, 52, 20, 62, 30, 54, 22 },
+			{  3, 35, 11, 43,  1, 33,  9, 41 },
+			{ 51, 19, 59, 27, 49, 17, 57, 25 },
+			{ 15, 47,  7, 39, 13, 45,  5, 37 },
+			{ 63, 31, 55, 23, 61, 29, 53, 21 }
+		};
+
+		int row_size = img.width * 3;
+		std::vector<float> row(img.tone_mapped ? 0 : row_size);
+
+		for (int j = j0; j < j1; ++j)
+		{
+			const float* in = img.linear + static_cast<size_t>(j) * row_size;
+			unsigned char* out = img.bytes.data() + static_cast<size_t>(j) * row_size;
+
+			if (!img.tone_mapped)
+			{
+				apply_tone_curve(in, row.data(), row_size, scale);
+				in = row.data();
+			}
+
+			// Added before truncating: 0.5 rounds to the nearest value, the dither thresholds spread it.
+			float offsets[pattern_size];
+
+			for (int k = 0; k < pattern_size; ++k)
+			{
+				offsets[k] = dither ? (bayer[j & 7][(k / 3) & 7] + 0.5f) / 64.0f : 0.5f;
+			}
+
+			int k = 0;
+
+#ifdef POST_PROCESS_SSE2
+			for (; k + pattern_size <= row_size; k += pattern_size)
+			{
+				for (int g = 0; g < pattern_size; g += 16)
+				{
+					__m128i low = _mm_packs_epi32(encode_sse2(in + k + g, offsets + g), encode_sse2(in + k + g + 4, offsets + g + 4));
+					__m128i high = _mm_packs_epi32(encode_sse2(in + k + g + 8, offsets + g + 8), encode_sse2(in + k + g + 12, offsets + g + 12));
+
+					_mm_storeu_si128(reinterpret_cast<__m128i*>(out + k + g), _mm_packus_epi16(low, high));
+				}
+			}
+#endif
+
+			for (; k < row_size; ++k)
+			{
+				out[k] = static_cast<unsigned char>(std::min(255.0f * encode_value(in[k]) + offsets[k % pattern_size], 255.0f));
+			}
+		}
+	}
+
+	// sRGB above its linear toe, fitted as a combination of 1, x, x^(1/2), x^(1/4) and x^(3/4), within 0.01
+	// of an 8-bit step of the exact curve: two square roots, which vectorize where the power doesn't.
+	static constexpr float srgb_toe = 0.0031308f;
+
+	static const float* get_srgb_fit()
+	{
+		static const float fit[5] = { 1.122688944f, 0.196133497f, 0.081334154f, -0.064611271f, -0.335510893f };
+
+		return fit;
+	}
+
+	float encode_value(float x) const
+	{
+		// The clamps are ordered so that NaNs become 0. Resampling may also undershoot 0.
+		x = std::min(std::max(x, 0.0f), 1.0f);
+
+		float s1 = std::sqrt(x);
+
+		if (transfer == transfer_function::gamma_2)
+		{
+			return s1;
+		}
+
+		if (x <= srgb_toe)
+		{
+			return 12.92f * x;
+		}
+
+		const float* srgb_fit = get_srgb_fit();
+		float s2 = std::sqrt(s1);
+
+		return srgb_fit[0] * s1 + srgb_fit[1] * s2 + srgb_fit[2] * x + srgb_fit[3] + srgb_fit[4] * s1 * s2;
+	}
+
+#ifdef POST_PROCESS_SSE2
+	__m128i encode_sse2(const float* in, const float* offsets) const
+	{
+		// "encode_value" of four values, scaled to [0, 255], offset and truncated. Max before min turns NaNs into 0.
+		__m128 x = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(in), _mm_setzero_ps()), _mm_set1_ps(1.0f));
+		__m128 e = _mm_sqrt_ps(x);
+
+		if (transfer == transfer_function::srgb)
+		{
+			const float* srgb_fit = get_srgb_fit();
+			__m128 s2 = _mm_sqrt_ps(e);
+			__m128 fit = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(srgb_fit[0]), e), _mm_mul_ps(_mm_set1_ps(srgb_fit[1]), s2)),
+									_mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(srgb_fit[2]), x), _mm_set1_ps(srgb_fit[3])), _mm_mul_ps(_mm_set1_ps(srgb_fit[4]), _mm_mul_ps(e, s2))));
+			__m128 toe = _mm_cmple_ps(x, _mm_set1_ps(srgb_toe));
+
+			e = _mm_or_ps(_mm_and_ps(toe, _mm_mul_ps(_mm_set1_ps(12.92f), x)), _mm_andnot_ps(toe, fit));
+		}
+
+		return _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(255.0f), e), _mm_loadu_ps(offsets)));
+	}
+#endif
+
+	void run_bands(int height, const std::function<void(int, int)>& band)
+	{
+		std::vector<std::function<void()>> tasks;
+
+		for (int j0 = 0; j0 < height; j0 += band_rows)
+		{
+			int j1 = std::min(j0 + band_rows, height);
+
+			tasks.push_back([&band, j0, j1] { band(j0, j1); });
+		}
+
+		run_tasks(tasks);
+	}
+
+	void run_tasks(const std::vector<std::function<void()>>& tasks)
+	{
+		// Runs "tasks" on the pool and waits for them only, as the pool may be shared with other work.
+		if (!pool)
+		{
+			for (const auto& task : tasks)
+			{
+				task();
+			}
+
+			return;
+		}
+
+		std::mutex done_mutex;
+		std::condition_variable done_condition;
+		size_t num_done = 0;
+
+		for (const auto& task : tasks)
+		{
+			pool->enqueue([&task, &done_mutex, &done_condition, &num_done] {
+				task();
+
+				// Notified under the lock, since the waiter may return and destroy the condition right after.
+				std::unique_lock<std::mutex> lock(done_mutex);
+
+				num_done++;
+				done_condition.notify_one();
+			});
+		}
+
+		std::unique_lock<std::mutex> lock(done_mutex);
+
+		done_condition.wait(lock, [&] { return num_done == tasks.size(); });
+	}
+
+	static file_type get_file_type(const std::string& filename)
+	{
+		size_t dot = filename.rfind('.');
+		std::string extension = dot == std::string::npos ? "" : filename.substr(dot + 1);
+
+		std::transform(extension.begin(), extension.end(), extension.begin(), [](char c) { return static_cast<char>(std::tolower(static_cast<unsigned char>(c))); });
+
+		if (extension == "jpg" || extension == "jpeg") { return file_type::jpg; }
+		if (extension == "png") { return file_type::png; }
+		if (extension == "hdr") { return file_type::hdr; }
+
+		return file_type::unknown;
+	}
+};
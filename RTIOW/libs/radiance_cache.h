@@ -0,0 +1,154 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+#include "common.h"
+
+#include "color.h"
+
+// World-space hash grid of the radiance leaving diffuse surfaces, filled as paths are traced. Paths that
+// reach a cell holding enough samples mostly stop there and reuse its mean, trading bias for far fewer
+// secondary rays. The bias comes from:
+// - the cell size, which blurs the lighting over each cell;
+// - "min_samples", the count of estimates a mean needs before it is reused at all;
+// - "refine_fraction", the share of lookups of a settled cell that are refused anyway, so that their paths
+//   are traced in full and keep adding estimates: the count of a cell grows with the samples per pixel,
+//   and its noise keeps averaging out instead of being frozen as blotches;
+// - estimates being made at any remaining depth, so a mean slightly underestimates the light of long
+//   paths when "max_depth" is small. Larger depths make this negligible.
+// The table has a fixed capacity, so memory stays bounded; cells that don't fit are simply not cached.
+// Lookups and updates are lock-free. Nothing is ever evicted, so a cache is only valid for the scene
+// (and lighting) it was filled with; a changed scene needs a new one.
+class radiance_cache
+{
+public:
+	radiance_cache(int capacity_log2 = 18, double _cell_size = 0.1, uint32_t _min_samples = 8, double _refine_fraction = 0.125)
+		: capacity(size_t(1) << capacity_log2), cell_size(_cell_size), min_samples(_min_samples), refine_fraction(_refine_fraction), entries(new entry[size_t(1) << capacity_log2])
+	{
+		for (size_t e = 0; e < capacity; ++e)
+		{
+			entries[e].key.store(0, std::memory_order_relaxed);
+			entries[e].sum[0].store(0.0, std::memory_order_relaxed);
+			entries[e].sum[1].store(0.0, std::memory_order_relaxed);
+			entries[e].sum[2].store(0.0, std::memory_order_relaxed);
+			entries[e].count.store(0, std::memory_order_relaxed);
+		}
+	}
+
+	bool lookup(const point3& p, const vec3& normal, color& radiance) const
+	{
+		// Returns whether the cell of (p, normal) holds enough samples, along with their mean. A share of
+		// the lookups of settled cells still fails, so that the caller traces the path and adds to the cell.
+		const entry* e = find(cell_key(p, normal), false);
+
+		if (!e)
+		{
+			return false;
+		}
+
+		uint32_t count = e->count.load(std::memory_order_acquire);
+
+		if (count < min_samples || random_double() < refine_fraction)
+		{
+			return false;
+		}
+
+		radiance = color(e->sum[0].load(std::memory_order_relaxed), e->sum[1].load(std::memory_order_relaxed), e->sum[2].load(std::memory_order_relaxed)) / count;
+
+		return true;
+	}
+
+	void add(const point3& p, const vec3& normal, const color& radiance)
+	{
+		entry* e = find(cell_key(p, normal), true);
+
+		if (!e)
+		{
+			return;
+		}
+
+		for (int c = 0; c < 3; ++c)
+		{
+			double current = e->sum[c].load(std::memory_order_relaxed);
+
+			while (!e->sum[c].compare_exchange_weak(current, current + radiance[c], std::memory_order_relaxed))
+			{
+			}
+		}
+
+		e->count.fetch_add(1, std::memory_order_release);
+	}
+
+private:
+	class entry
+	{
+	public:
+		std::atomic<uint64_t> key; // Zero for an empty entry.
+		std::atomic<double> sum[3];
+		std::atomic<uint32_t> count;
+	};
+
+	static const int max_probes = 16; // Linear probes before giving up on a cell.
+
+	size_t capacity;
+	double cell_size;
+	uint32_t min_samples;
+	double refine_fraction;
+	std::unique_ptr<entry[]> entries;
+
+	entry* find(uint64_t key, bool insert) const
+	{
+		size_t mask = capacity - 1;
+
+		for (int probe = 0; probe < max_probes; ++probe)
+		{
+			entry& e = entries[(key + probe) & mask];
+			uint64_t current = e.key.load(std::memory_order_acquire);
+
+			if (current == key)
+			{
+				return &e;
+			}
+
+			if (current == 0)
+			{
+				if (!insert)
+				{
+					return nullptr;
+				}
+
+				// Claim the empty entry, unless another thread just did, possibly for the same key.
+				if (e.key.compare_exchange_strong(current, key, std::memory_order_acq_rel) || current == key)
+				{
+					return &e;
+				}
+			}
+		}
+
+		return nullptr;
+	}
+
+	uint64_t cell_key(const point3& p, const vec3& normal) const
+	{
+		// Cells also split by the dominant axis of the normal, so both sides of a thin surface stay apart.
+		int axis = (std::fabs(normal.x()) > std::fabs(normal.y())) ? ((std::fabs(normal.x()) > std::fabs(normal.z())) ? 0 : 2) : ((std::fabs(normal.y()) > std::fabs(normal.z())) ? 1 : 2);
+		uint64_t direction = static_cast<uint64_t>(2 * axis + (normal[axis] < 0.0 ? 1 : 0));
+
+		uint64_t x = static_cast<uint64_t>(static_cast<int64_t>(std::floor(p.x() / cell_size)));
+		uint64_t y = static_cast<uint64_t>(static_cast<int64_t>(std::floor(p.y() / cell_size)));
+		uint64_t z = static_cast<uint64_t>(static_cast<int64_t>(std::floor(p.z() / cell_size)));
+
+		uint64_t h = x * 0x9E3779B97F4A7C15ull ^ y * 0xC2B2AE3D27D4EB4Full ^ z * 0x165667B19E3779F9ull ^ direction * 0xD6E8FEB86659FD93ull;
+
+		// Finalizer of SplitMix64.
+		h ^= h >> 30;
+		h *= 0xBF58476D1CE4E5B9ull;
+		h ^= h >> 27;
+		h *= 0x94D049BB133111EBull;
+		h ^= h >> 31;
+
+		return h == 0 ? 1 : h;
+	}
+};
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstdint>
+
+#include "common.h"
+
+const int packet_width = 4; // Packets are "packet_width" by "packet_width" blocks of neighbouring pixels.
+const int packet_size = packet_width * packet_width; // Count of rays (lanes) in a packet.
+const int packet_min_coherent_lanes = 3; // Below this count of active lanes, packets are traced as single rays.
+
+inline int lane_count(uint32_t mask)
+{
+	int count = 0;
+
+	for (; mask != 0; mask &= mask - 1)
+	{
+		count++;
+	}
+
+	return count;
+}
+
+class ray_packet
+{
+public:
+	ray rays[packet_size];
+
+	// Structure-of-arrays copy of the rays, for the lane-parallel tests.
+	double origin[3][packet_size];
+	double inv_direction[3][packet_size];
+
+	// Bounds of the origins and inverse directions over the active lanes.
+	interval origin_bounds[3];
+	interval inv_direction_bounds[3];
+
+	uint32_t active = 0; // Mask of the lanes holding a ray.
+	bool coherent = false; // Whether all active directions share their signs, so the packet bounds are finite.
+
+	void set_ray(int lane, const ray& r)
+	{
+		rays[lane] = r;
+		active |= 1u << lane;
+	}
+
+	void finalize()
+	{
+		// Fills the lane-parallel arrays and the packet bounds once every ray has been set.
+		int signs[3] = { 0, 0, 0 };
+		coherent = active != 0;
+
+		for (int axis = 0; axis < 3; axis++)
+		{
+			origin_bounds[axis] = interval();
+			inv_direction_bounds[axis] = interval();
+		}
+
+		for (int lane = 0; lane < packet_size; ++lane)
+		{
+			// Inactive lanes repeat a live ray, so the lane-parallel loops stay well defined.
+			const ray& r = (active & (1u << lane)) ? rays[lane] : rays[first_active_lane()];
+
+			for (int axis = 0; axis < 3; axis++)
+			{
+				double d = r.get_direction()[axis];
+
+				origin[axis][lane] = r.get_origin()[axis];
+				inv_direction[axis][lane] = r.get_inv_direction()[axis];
+
+				origin_bounds[axis] = interval(origin_bounds[axis], interval(origin[axis][lane], origin[axis][lane]));
+				inv_direction_bounds[axis] = interval(inv_direction_bounds[axis], interval(inv_direction[axis][lane], inv_direction[axis][lane]));
+
+				int sign = (d > 0.0) ? 1 : ((d < 0.0) ? -1 : 0);
+
+				coherent &= sign != 0 && (signs[axis] == 0 || signs[axis] == sign);
+				signs[axis] = sign;
+			}
+		}
+	}
+
+private:
+	int first_active_lane() const
+	{
+		int lane = 0;
+
+		while (lane < packet_size - 1 && !(active & (1u << lane)))
+		{
+			lane++;
+		}
+
+		return lane;
+	}
+};
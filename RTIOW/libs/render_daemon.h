@@ -0,0 +1,344 @@
+#pragma once
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <dirent.h>
+#endif
+
+#include "common.h"
+
+#include "camera.h"
+#include "environment.h"
+#include "hittable.h"
+#include "post_process.h"
+#include "render_queue.h"
+#include "thread_pool.h"
+
+// Long-running renderer fed through a spool directory, so that any number of renders share the workers
+// of one process instead of each starting its own pool.
+//
+// A job is a "<name>.job" text file dropped into the directory, with one "<setting> <values...>" line per
+// camera setting to change ("image_width 640", "lookfrom 13 2 3", ...), plus "scene <name>", "output <file>"
+// (a ".jpg", ".png" or ".hdr" file), "priority <n>" and "max_threads <n>". Once picked up it is renamed to
+// "<name>.job.accepted", then to "<name>.job.done", "<name>.job.cancelled" or "<name>.job.failed". Creating
+// "<name>.cancel" cancels a job, and creating "stop" makes the daemon finish its jobs and return. The queue
+// depth and the throughput of every job are kept up to date in "status.txt".
+class render_daemon
+{
+public:
+	int poll_interval = 250; // Milliseconds between scans of the spool directory.
+
+	render_daemon(const std::string& _spool_directory, thread_pool& pool) : spool_directory(_spool_directory), queue(pool) {}
+
+	void add_scene(const std::string& name, std::function<std::shared_ptr<hittable>()> build)
+	{
+		// Scenes are built the first time a job asks for them, then shared by every later job.
+		scene_builders[name] = build;
+	}
+
+	void run()
+	{
+		std::clog << "Watching \"" << spool_directory << "\" for jobs." << std::endl;
+
+		while (!exists(path("stop")))
+		{
+			accept_jobs();
+			cancel_jobs();
+			retire_jobs();
+			write_status();
+
+			std::this_thread::sleep_for(std::chrono::milliseconds(poll_interval));
+		}
+
+		queue.wait();
+
+		retire_jobs();
+		write_status();
+
+		std::remove(path("stop").c_str());
+		std::clog << '\n' << "Stopped." << std::endl;
+	}
+
+private:
+	std::string spool_directory;
+	render_queue queue;
+	std::map<std::string, std::function<std::shared_ptr<hittable>()>> scene_builders;
+	std::map<std::string, std::shared_ptr<hittable>> scenes;
+	std::map<int, std::string> accepted; // Spool file names of the jobs in the queue, by job id.
+
+	void accept_jobs()
+	{
+		for (const std::string& filename : list_jobs())
+		{
+			std::string name = filename.substr(0, filename.size() - 4);
+			std::string accepted_filename = path(filename + ".accepted");
+
+			// Renaming claims the file, so a job is never picked up twice.
+			if (std::rename(path(filename).c_str(), accepted_filename.c_str()) != 0)
+			{
+				continue;
+			}
+
+			render_job job;
+			std::string error;
+
+			job.name = name;
+
+			if (!parse_job(accepted_filename, job, error))
+			{
+				std::clog << '\n' << "Rejected job \"" << name << "\": " << error << std::endl;
+				std::rename(accepted_filename.c_str(), path(filename + ".failed").c_str());
+
+				continue;
+			}
+
+			int id = queue.submit(job);
+			accepted[id] = filename;
+
+			std::clog << '\n' << "Accepted job \"" << name << "\" (priority " << job.priority << ", " << job.cam.image_width << " px, " << job.cam.samples_per_pixel << " spp)." << std::endl;
+		}
+	}
+
+	void cancel_jobs()
+	{
+		for (auto& job : accepted)
+		{
+			std::string cancel_filename = path(job.second.substr(0, job.second.size() - 4) + ".cancel");
+
+			if (exists(cancel_filename))
+			{
+				queue.cancel(job.first);
+				std::remove(cancel_filename.c_str());
+			}
+		}
+	}
+
+	void retire_jobs()
+	{
+		for (const render_job_status& status : queue.take_finished())
+		{
+			const std::string& filename = accepted[status.id];
+			const char* suffix = status.cancelled ? ".cancelled" : (status.failed ? ".failed" : ".done");
+
+			std::rename(path(filename + ".accepted").c_str(), path(filename + suffix).c_str());
+			accepted.erase(status.id);
+
+			if (status.failed)
+			{
+				std::clog << '\n' << "Failed to write the output of job \"" << status.name << "\"." << std::endl;
+				continue;
+			}
+
+			std::clog << '\n' << (status.cancelled ? "Cancelled" : "Finished") << " job \"" << status.name << "\" in " << status.elapsed << " s, "
+					  << status.samples_per_second / 1.0e6 << " M samples/s." << std::endl;
+		}
+	}
+
+	void write_status()
+	{
+		std::vector<render_job_status> jobs = queue.get_status();
+		std::ofstream file(path("status.txt.tmp"));
+
+		file << "queue_depth " << queue.get_queue_depth() << '\n';
+
+		for (const render_job_status& status : jobs)
+		{
+			file << status.name << ": priority " << status.priority << ", " << status.running_threads << " threads, "
+				 << status.done_tiles << "/" << status.total_tiles << " tiles" << (status.skipped_tiles > 0 ? " (" + std::to_string(status.skipped_tiles) + " skipped)" : "") << ", "
+				 << status.samples_per_second / 1.0e6 << " M samples/s\n";
+		}
+
+		file.close();
+
+		// Replaced whole, so readers never see a half-written report. Renaming only overwrites on POSIX.
+#ifdef _WIN32
+		std::remove(path("status.txt").c_str());
+#endif
+		std::rename(path("status.txt.tmp").c_str(), path("status.txt").c_str());
+	}
+
+	bool parse_job(const std::string& filename, render_job& job, std::string& error)
+	{
+		std::ifstream file(filename);
+		std::string line, scene_name;
+
+		while (std::getline(file, line))
+		{
+			std::istringstream values(line);
+			std::string key;
+
+			if (!(values >> key) || key[0] == '#')
+			{
+				continue;
+			}
+
+			camera& cam = job.cam;
+			double x, y, z;
+			bool valid = true;
+
+			if (key == "scene") { valid = static_cast<bool>(values >> scene_name); }
+			else if (key == "output") { valid = static_cast<bool>(values >> job.output_filename); }
+			else if (key == "priority") { valid = static_cast<bool>(values >> job.priority); }
+			else if (key == "max_threads") { valid = static_cast<bool>(values >> job.max_threads); }
+			else if (key == "aspect_ratio") { valid = static_cast<bool>(values >> cam.aspect_ratio); }
+			else if (key == "image_width") { valid = static_cast<bool>(values >> cam.image_width); }
+			else if (key == "samples_per_pixel") { valid = static_cast<bool>(values >> cam.samples_per_pixel); }
+			else if (key == "max_depth") { valid = static_cast<bool>(values >> cam.max_depth); }
+			else if (key == "vfov") { valid = static_cast<bool>(values >> cam.vfov); }
+			else if (key == "lookfrom") { valid = static_cast<bool>(values >> x >> y >> z); cam.lookfrom = point3(x, y, z); }
+			else if (key == "lookat") { valid = static_cast<bool>(values >> x >> y >> z); cam.lookat = point3(x, y, z); }
+			else if (key == "vup") { valid = static_cast<bool>(values >> x >> y >> z); cam.vup = vec3(x, y, z); }
+			else if (key == "defocus_angle") { valid = static_cast<bool>(values >> cam.defocus_angle); }
+			else if (key == "focus_distance") { valid = static_cast<bool>(values >> cam.focus_distance); }
+			else if (key == "tile_size") { valid = static_cast<bool>(values >> cam.tile_size); }
+			else if (key == "environment")
+			{
+				std::string environment_filename;
+
+				valid = static_cast<bool>(values >> environment_filename) && (cam.environment = environment_light::load(environment_filename.c_str())) != nullptr;
+			}
+			else
+			{
+				error = "unknown setting \"" + key + "\"";
+
+				return false;
+			}
+
+			if (!valid)
+			{
+				error = "bad value for \"" + key + "\"";
+
+				return false;
+			}
+		}
+
+		if (!valid_camera(job.cam))
+		{
+			error = "image_width, samples_per_pixel, max_depth and tile_size must be positive";
+
+			return false;
+		}
+
+		if (job.output_filename.empty())
+		{
+			error = "no output";
+
+			return false;
+		}
+
+		if (!post_process::is_supported(job.output_filename))
+		{
+			error = "output \"" + job.output_filename + "\" is not a .jpg, .png or .hdr file";
+
+			return false;
+		}
+
+		job.world = scene(scene_name);
+
+		if (!job.world)
+		{
+			error = "unknown scene \"" + scene_name + "\"";
+
+			return false;
+		}
+
+		return true;
+	}
+
+	static bool valid_camera(const camera& cam)
+	{
+		return cam.image_width > 0 && cam.samples_per_pixel > 0 && cam.max_depth > 0 && cam.tile_size > 0 && cam.aspect_ratio > 0.0;
+	}
+
+	std::shared_ptr<hittable> scene(const std::string& name)
+	{
+		auto built = scenes.find(name);
+
+		if (built != scenes.end())
+		{
+			return built->second;
+		}
+
+		auto builder = scene_builders.find(name);
+
+		if (builder == scene_builders.end())
+		{
+			return nullptr;
+		}
+
+		return scenes[name] = builder->second();
+	}
+
+	std::vector<std::string> list_jobs() const
+	{
+		// Names of the "*.job" files in the spool directory.
+		std::vector<std::string> filenames, jobs;
+
+#ifdef _WIN32
+		WIN32_FIND_DATAA data;
+		HANDLE find = FindFirstFileA(path("*.job").c_str(), &data);
+
+		if (find != INVALID_HANDLE_VALUE)
+		{
+			do
+			{
+				filenames.push_back(data.cFileName);
+			} while (FindNextFileA(find, &data));
+
+			FindClose(find);
+		}
+#else
+		DIR* directory = opendir(spool_directory.c_str());
+
+		if (directory)
+		{
+			while (dirent* entry = readdir(directory))
+			{
+				filenames.push_back(entry->d_name);
+			}
+
+			closedir(directory);
+		}
+#endif
+
+		// Windows patterns also match longer extensions through short file names, so check again.
+		for (const std::string& filename : filenames)
+		{
+			if (filename.size() > 4 && filename.compare(filename.size() - 4, 4, ".job") == 0)
+			{
+				jobs.push_back(filename);
+			}
+		}
+
+		return jobs;
+	}
+
+	std::string path(const std::string& filename) const
+	{
+		return spool_directory + "/" + filename;
+	}
+
+	static bool exists(const std::string& filename)
+	{
+		return std::ifstream(filename).good();
+	}
+};
@@ -0,0 +1,342 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <condition_variable>
+
+#include "common.h"
+
+#include "camera.h"
+#include "color.h"
+#include "hittable.h"
+#include "post_process.h"
+#include "thread_pool.h"
+
+class render_job
+{
+public:
+	std::string name; // Shown in status reports.
+	camera cam;
+	std::shared_ptr<hittable> world;
+	std::string output_filename;
+	int priority = 0; // Higher priorities take every free worker before lower ones get any.
+	int max_threads = 0; // Most workers rendering tiles of this job at once, or 0 for no limit.
+};
+
+class render_job_status
+{
+public:
+	int id;
+	std::string name;
+	int priority;
+	int running_threads;
+	int done_tiles, total_tiles;
+	int skipped_tiles; // Tiles of a cancelled job dropped instead of rendered.
+	bool finished, cancelled;
+	bool failed; // The job rendered every tile, but its output could not be written.
+	double elapsed; // Seconds since the first tile started.
+	double samples_per_second; // Camera samples traced per second so far.
+};
+
+// Shares one thread pool among many render jobs, tile by tile. Every time a worker frees up, the next tile
+// comes from the highest-priority job still below its thread cap, in turn with the other jobs of that
+// priority, so jobs interleave fairly and a new high-priority job takes over as soon as running tiles end.
+class render_queue
+{
+public:
+	render_queue(thread_pool& _pool) : pool(_pool), num_in_flight(0), num_dispatched(0), next_id(1) {}
+
+	~render_queue()
+	{
+		// Tasks still queued on the pool refer to this queue, so drain them before going away.
+		std::unique_lock<std::mutex> lock(queue_mutex);
+
+		for (auto& job : jobs)
+		{
+			job->cancelled = true;
+		}
+
+		idle.wait(lock, [this] { return num_in_flight == 0; });
+	}
+
+	int submit(const render_job& job)
+	{
+		// Queues "job" and returns its id.
+		std::unique_ptr<state> s(new state(job));
+
+		std::unique_lock<std::mutex> lock(queue_mutex);
+
+		s->id = next_id++;
+		int id = s->id;
+
+		jobs.push_back(std::move(s));
+		dispatch();
+
+		return id;
+	}
+
+	void cancel(int id)
+	{
+		// Tiles of the job already being rendered finish, the others are dropped. No output is written.
+		std::unique_lock<std::mutex> lock(queue_mutex);
+
+		for (auto& job : jobs)
+		{
+			if (job->id == id && !job->finished)
+			{
+				job->cancelled = true;
+			}
+		}
+
+		retire_finished();
+		idle.notify_all();
+	}
+
+	void wait()
+	{
+		// Blocks until every job submitted so far is finished or cancelled.
+		std::unique_lock<std::mutex> lock(queue_mutex);
+
+		idle.wait(lock, [this] {
+			for (auto& job : jobs)
+			{
+				if (!job->finished)
+				{
+					return false;
+				}
+			}
+
+			return true;
+		});
+	}
+
+	int get_queue_depth()
+	{
+		// Jobs not finished yet, whether rendering or waiting for workers.
+		std::unique_lock<std::mutex> lock(queue_mutex);
+		int depth = 0;
+
+		for (auto& job : jobs)
+		{
+			depth += job->finished ? 0 : 1;
+		}
+
+		return depth;
+	}
+
+	std::vector<render_job_status> get_status()
+	{
+		std::unique_lock<std::mutex> lock(queue_mutex);
+		std::vector<render_job_status> status;
+
+		for (auto& job : jobs)
+		{
+			status.push_back(job->status());
+		}
+
+		return status;
+	}
+
+	std::vector<render_job_status> take_finished()
+	{
+		// Returns the jobs finished or cancelled since the last call, and forgets them.
+		std::unique_lock<std::mutex> lock(queue_mutex);
+		std::vector<render_job_status> finished;
+
+		for (size_t n = 0; n < jobs.size();)
+		{
+			if (jobs[n]->finished)
+			{
+				finished.push_back(jobs[n]->status());
+				jobs.erase(jobs.begin() + n);
+			}
+			else
+			{
+				++n;
+			}
+		}
+
+		return finished;
+	}
+
+private:
+	class state
+	{
+	public:
+		render_job job;
+		int id;
+		int tiles_x, tiles_y;
+		int next_tile, done_tiles, skipped_tiles;
+		int running_threads;
+		uint64_t last_dispatch; // Order of the last tile handed out, for round-robin among equal priorities.
+		std::atomic<bool> cancelled; // Also read by the workers, off the lock.
+		bool finished, failed;
+		std::vector<float> pixels; // Linear radiance, encoded when the last tile is done.
+		std::chrono::steady_clock::time_point start, end;
+
+		state(const render_job& _job) : job(_job), id(0), next_tile(0), done_tiles(0), skipped_tiles(0), running_threads(0), last_dispatch(0), cancelled(false), finished(false), failed(false)
+		{
+			job.cam.initialize();
+
+			tiles_x = (job.cam.image_width + job.cam.tile_size - 1) / job.cam.tile_size;
+			tiles_y = (job.cam.image_height + job.cam.tile_size - 1) / job.cam.tile_size;
+
+			pixels.assign(job.cam.image_width * job.cam.image_height * 3, 0.0f);
+		}
+
+		bool runnable() const
+		{
+			return !cancelled && next_tile < tiles_x * tiles_y && (job.max_threads <= 0 || running_threads < job.max_threads);
+		}
+
+		render_job_status status() const
+		{
+			render_job_status s;
+
+			s.id = id;
+			s.name = job.name;
+			s.priority = job.priority;
+			s.running_threads = running_threads;
+			s.done_tiles = done_tiles;
+			s.total_tiles = tiles_x * tiles_y;
+			s.skipped_tiles = skipped_tiles;
+			s.finished = finished;
+			s.cancelled = cancelled;
+			s.failed = failed;
+			s.elapsed = next_tile > 0 ? std::chrono::duration<double>((finished ? end : std::chrono::steady_clock::now()) - start).count() : 0.0;
+			s.samples_per_second = s.elapsed > 0.0 ? rendered_samples() / s.elapsed : 0.0;
+
+			return s;
+		}
+
+		double rendered_samples() const
+		{
+			// Full tiles are an estimate for the cropped ones on the right and bottom edges.
+			double tile_pixels = static_cast<double>(job.cam.tile_size) * job.cam.tile_size;
+			double image_pixels = static_cast<double>(job.cam.image_width) * job.cam.image_height;
+
+			return std::min(done_tiles * tile_pixels, image_pixels) * job.cam.samples_per_pixel;
+		}
+	};
+
+	thread_pool& pool;
+	std::vector<std::unique_ptr<state>> jobs;
+	std::mutex queue_mutex;
+	std::condition_variable idle;
+	int num_in_flight; // Tiles handed to the pool and not finished yet.
+	uint64_t num_dispatched;
+	int next_id;
+
+	void dispatch()
+	{
+		// Hands tiles to the pool until every worker has one, or no job may take more. Called with the lock held.
+		while (num_in_flight < pool.size())
+		{
+			state* next = nullptr;
+
+			for (auto& job : jobs)
+			{
+				if (!job->runnable())
+				{
+					continue;
+				}
+
+				if (!next || job->job.priority > next->job.priority || (job->job.priority == next->job.priority && job->last_dispatch < next->last_dispatch))
+				{
+					next = job.get();
+				}
+			}
+
+			if (!next)
+			{
+				return;
+			}
+
+			if (next->next_tile == 0)
+			{
+				next->start = std::chrono::steady_clock::now();
+			}
+
+			int tile = next->next_tile++;
+
+			next->running_threads++;
+			next->last_dispatch = ++num_dispatched;
+			num_in_flight++;
+
+			pool.enqueue([this, next, tile] { render_tile(next, tile); });
+		}
+	}
+
+	void render_tile(state* s, int tile)
+	{
+		// The job may be cancelled meanwhile, but it stays alive while it has tiles running.
+		bool skipped = s->cancelled;
+
+		if (!skipped)
+		{
+			camera& cam = s->job.cam;
+			double pixel_samples_scale = 1.0 / cam.samples_per_pixel;
+
+			cam.render_tile(*s->job.world, s->tiles_x, tile, cam.samples_per_pixel, [&](int i, int j, const color& pixel_color) {
+				write_color_into_float_buffer(s->pixels.data(), (j * cam.image_width + i) * 3, pixel_samples_scale * pixel_color);
+			});
+		}
+
+		std::unique_lock<std::mutex> lock(queue_mutex);
+
+		if (skipped)
+		{
+			s->skipped_tiles++;
+		}
+		else
+		{
+			s->done_tiles++;
+		}
+
+		if (!s->cancelled && s->done_tiles == s->tiles_x * s->tiles_y)
+		{
+			// Written off the lock, so the other workers keep getting tiles meanwhile. The tile counts as
+			// running until then, so that the job can't be retired from under the write. The encoding runs on
+			// this worker, since handing it to the pool and waiting for it here could deadlock.
+			lock.unlock();
+
+			post_process post;
+			post.transfer = transfer_function::gamma_2; // Square root, as in the book.
+			post.add_output(s->job.output_filename);
+
+			bool written = post.write(s->pixels.data(), s->job.cam.image_width, s->job.cam.image_height);
+			s->pixels = std::vector<float>();
+
+			lock.lock();
+			s->failed = !written;
+			s->finished = true;
+			s->end = std::chrono::steady_clock::now();
+		}
+
+		s->running_threads--;
+		num_in_flight--;
+
+		retire_finished();
+		dispatch();
+
+		lock.unlock();
+		idle.notify_all();
+	}
+
+	void retire_finished()
+	{
+		// Cancelled jobs are finished once their running tiles are. Called with the lock held.
+		for (auto& job : jobs)
+		{
+			if (job->cancelled && !job->finished && job->running_threads == 0)
+			{
+				job->finished = true;
+				job->end = std::chrono::steady_clock::now();
+			}
+		}
+	}
+};
@@ -0,0 +1,186 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <vector>
+#include <condition_variable>
+
+#include "common.h"
+
+#include "camera.h"
+#include "color.h"
+#include "hittable.h"
+#include "thread_pool.h"
+#include "tile_summary.h"
+
+// Renders one frame by tiles on a shared thread pool, straight into a caller-owned RGB buffer. Several
+// sessions may run on the same pool at once; each one only waits for its own tiles.
+class render_session
+{
+public:
+	std::function<void(double)> on_progress; // Called with the fraction of tiles done, in [0, 1].
+	std::function<void(int, int, int, int)> on_tile_completed; // Called with the pixel bounds [i0, i1) x [j0, j1) of a finished tile.
+
+	render_session(const camera& _cam, const hittable& _world, thread_pool& _pool)
+		: cam(_cam), world(_world), pool(_pool), float_buffer(nullptr), summaries(nullptr), cancelled(false), started(false), num_done_tiles(0)
+	{
+		cam.initialize();
+
+		tiles_x = (cam.image_width + cam.tile_size - 1) / cam.tile_size;
+		tiles_y = (cam.image_height + cam.tile_size - 1) / cam.tile_size;
+
+		for (int tile = 0; tile < tiles_x * tiles_y; ++tile)
+		{
+			tiles.push_back(tile);
+		}
+	}
+
+	~render_session()
+	{
+		// Tasks still queued on the pool refer to this session, so drain them before going away.
+		if (started)
+		{
+			cancel();
+			wait();
+		}
+	}
+
+	int get_image_width() const { return cam.image_width; }
+	int get_image_height() const { return cam.image_height; }
+	int get_tile_count() const { return tiles_x * tiles_y; }
+
+	void set_output(float* buffer)
+	{
+		// Linear radiance, 3 floats per pixel, "image_width * image_height * 3" floats in total.
+		float_buffer = buffer;
+	}
+
+	void set_tiles(const std::vector<int>& _tiles)
+	{
+		// Restricts the session to a subset of the tiles, leaving the other pixels of the buffer untouched.
+		tiles = _tiles;
+	}
+
+	void set_tile_summaries(tile_summary* _summaries)
+	{
+		// One summary per tile, "get_tile_count()" in total, rewritten with what the paths of each rendered tile touched.
+		summaries = _summaries;
+	}
+
+	void start()
+	{
+		started = true;
+
+		for (int tile : tiles)
+		{
+			pool.enqueue([this, tile] {
+				bool rendered = !cancelled;
+
+				if (rendered)
+				{
+					render_tile(tile);
+				}
+
+				std::unique_lock<std::mutex> lock(done_mutex);
+
+				done_tiles.push(rendered ? tile : -1);
+
+				lock.unlock();
+				done_condition.notify_one();
+			});
+		}
+	}
+
+	void cancel()
+	{
+		// Tiles already being rendered finish, the ones not started yet are skipped.
+		cancelled = true;
+	}
+
+	bool wait()
+	{
+		// Blocks until every tile is done or skipped, running the callbacks on the calling thread so they
+		// never hold up the workers. Returns whether the frame was rendered completely.
+		int num_tiles = static_cast<int>(tiles.size());
+		bool complete = true;
+
+		if (!started)
+		{
+			return false;
+		}
+
+		while (num_done_tiles < num_tiles)
+		{
+			std::unique_lock<std::mutex> lock(done_mutex);
+
+			done_condition.wait(lock, [this] { return !done_tiles.empty(); });
+
+			int tile = done_tiles.front();
+			done_tiles.pop();
+			num_done_tiles++;
+
+			lock.unlock();
+
+			if (tile < 0)
+			{
+				complete = false;
+				continue;
+			}
+
+			if (on_tile_completed)
+			{
+				int i0 = (tile % tiles_x) * cam.tile_size;
+				int j0 = (tile / tiles_x) * cam.tile_size;
+
+				on_tile_completed(i0, j0, std::min(i0 + cam.tile_size, cam.image_width), std::min(j0 + cam.tile_size, cam.image_height));
+			}
+
+			if (on_progress)
+			{
+				on_progress(static_cast<double>(num_done_tiles) / num_tiles);
+			}
+		}
+
+		return complete && !cancelled;
+	}
+
+private:
+	camera cam;
+	const hittable& world;
+	thread_pool& pool;
+	float* float_buffer;
+	tile_summary* summaries;
+	std::atomic<bool> cancelled;
+	bool started;
+	int tiles_x, tiles_y;
+	std::vector<int> tiles; // Tiles to render.
+	int num_done_tiles;
+	std::queue<int> done_tiles; // Finished tiles, or -1 for skipped ones, waiting for their callbacks.
+	std::mutex done_mutex;
+	std::condition_variable done_condition;
+
+	void render_tile(int tile)
+	{
+		double pixel_samples_scale = 1.0 / cam.samples_per_pixel;
+		tile_summary* summary = summaries ? &summaries[tile] : nullptr;
+
+		if (summary)
+		{
+			summary->clear();
+		}
+
+		cam.render_tile(world, tiles_x, tile, cam.samples_per_pixel, [&](int i, int j, const color& pixel_color) {
+			if (float_buffer)
+			{
+				write_color_into_float_buffer(float_buffer, (j * cam.image_width + i) * 3, pixel_samples_scale * pixel_color);
+			}
+		}, summary);
+
+		if (summary)
+		{
+			summary->finish();
+		}
+	}
+};
@@ -4,10 +4,15 @@
 
 #include "hittable.h"
 
-class sphere : public hittable
+class sphere final : public hittable
 {
 public:
-	sphere(point3 _center, double _radius, std::shared_ptr<material> _mat) : center(_center), radius(_radius), mat(_mat) {}
+	sphere(point3 _center, double _radius, std::shared_ptr<material> _mat) : center(_center), radius(_radius), mat(_mat)
+	{
+		vec3 radius_vector = vec3(radius, radius, radius);
+
+		bbox = aabb(center - radius_vector, center + radius_vector);
+	}
 
 	bool hit(const ray& r, interval ray_ti, hit_record& rec) const override
 	{
@@ -36,16 +41,67 @@ public:
 		}
 
 		rec.t = root;
+		rec.object = this;
+
+		return true;
+	}
+
+	void set_hit_attributes(const ray& r, hit_record& rec) const override
+	{
 		rec.p = r.at(rec.t);
 		vec3 outward_normal = (rec.p - center) / radius;
 		rec.set_face_normal(r, outward_normal);
-		rec.mat = mat;
+		rec.mat = mat.get();
+	}
 
-		return true;
+	aabb bounding_box() const override
+	{
+		return bbox;
+	}
+
+	uint32_t hit_packet(const ray_packet& packet, uint32_t mask, double ray_tmin, packet_hit& hits) const override
+	{
+		// Solve the quadratic of every lane at once, then record the accepted lanes only.
+		double roots[packet_size];
+
+		for (int lane = 0; lane < packet_size; ++lane)
+		{
+			const vec3& direction = packet.rays[lane].get_direction();
+			vec3 oc = packet.rays[lane].get_origin() - center;
+
+			double a = direction.length_squared();
+			double half_b = dot(oc, direction);
+			double c = oc.length_squared() - radius * radius;
+			double discriminant = half_b * half_b - a * c;
+			double sqrtd = std::sqrt(std::fmax(discriminant, 0.0));
+
+			double near_root = (-half_b - sqrtd) / a;
+			double far_root = (-half_b + sqrtd) / a;
+			double root = (near_root > ray_tmin) ? near_root : far_root;
+
+			roots[lane] = (discriminant >= 0.0 && root > ray_tmin) ? root : infinity;
+		}
+
+		uint32_t hit_lanes = 0;
+
+		for (int lane = 0; lane < packet_size; ++lane)
+		{
+			if ((mask & (1u << lane)) && roots[lane] < hits.t_max[lane])
+			{
+				hits.recs[lane].t = roots[lane];
+				hits.recs[lane].object = this;
+
+				hits.t_max[lane] = roots[lane];
+				hit_lanes |= 1u << lane;
+			}
+		}
+
+		return hit_lanes;
 	}
 
 private:
 	point3 center;
 	double radius;
 	std::shared_ptr<material> mat;
+	aabb bbox;
 };
@@ -0,0 +1,246 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+#include "common.h"
+
+#include "aabb.h"
+#include "bvh.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "sphere.h"
+
+// Closed-world scene: every primitive is a known type stored by value, under a flattened bounding volume
+// hierarchy. Primitive tests are direct calls the compiler can inline, instead of virtual calls through
+// "std::shared_ptr" at every node.
+class static_scene : public hittable
+{
+public:
+	static_scene(const hittable_list& list)
+	{
+		collect(list);
+
+		if (!primitives.empty())
+		{
+			nodes.reserve(2 * primitives.size());
+			build(0, primitives.size());
+		}
+	}
+
+	static bool supports(const hittable_list& list)
+	{
+		// Returns whether every object of the list, including nested lists, is of a known type.
+		for (const auto& object : list.objects)
+		{
+			const hittable_list* nested_list = dynamic_cast<const hittable_list*>(object.get());
+
+			if (nested_list ? !supports(*nested_list) : !dynamic_cast<const sphere*>(object.get()))
+			{
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	bool hit(const ray& r, interval ray_ti, hit_record& rec) const override
+	{
+		return !nodes.empty() && hit_node(0, r, ray_ti, rec);
+	}
+
+	aabb bounding_box() const override
+	{
+		return nodes.empty() ? aabb::empty : nodes[0].bbox;
+	}
+
+	uint32_t hit_packet(const ray_packet& packet, uint32_t mask, double ray_tmin, packet_hit& hits) const override
+	{
+		int stack_nodes[max_depth];
+		uint32_t stack_masks[max_depth];
+		int stack_size = 0;
+		uint32_t hit_lanes = 0;
+
+		if (!nodes.empty())
+		{
+			stack_nodes[stack_size] = 0;
+			stack_masks[stack_size++] = mask;
+		}
+
+		while (stack_size > 0)
+		{
+			stack_size--;
+
+			int node_index = stack_nodes[stack_size];
+			const node& n = nodes[node_index];
+			uint32_t lanes = n.bbox.hit_packet(packet, stack_masks[stack_size], ray_tmin, hits.t_max);
+
+			if (lanes == 0)
+			{
+				continue;
+			}
+
+			if (n.count > 0)
+			{
+				for (int k = n.start; k < n.start + n.count; ++k)
+				{
+					hit_lanes |= primitives[k].hit_packet(packet, lanes, ray_tmin, hits);
+				}
+			}
+			else if (lane_count(lanes) < packet_min_coherent_lanes)
+			{
+				// Once the packet has diverged, the few rays left are cheaper to traverse alone.
+				for (int lane = 0; lane < packet_size; ++lane)
+				{
+					if ((lanes & (1u << lane)) && hit_node(node_index, packet.rays[lane], interval(ray_tmin, hits.t_max[lane]), hits.recs[lane]))
+					{
+						hits.t_max[lane] = hits.recs[lane].t;
+						hit_lanes |= 1u << lane;
+					}
+				}
+			}
+			else
+			{
+				// Coherent lanes share their direction signs, so the first lane decides the nearer child.
+				bool left_first = packet.inv_direction[n.axis][0] >= 0.0;
+
+				stack_nodes[stack_size] = left_first ? n.right : node_index + 1;
+				stack_masks[stack_size++] = lanes;
+				stack_nodes[stack_size] = left_first ? node_index + 1 : n.right;
+				stack_masks[stack_size++] = lanes;
+			}
+		}
+
+		return hit_lanes;
+	}
+
+private:
+	class node
+	{
+	public:
+		aabb bbox;
+		int start; // First primitive of a leaf.
+		int count; // Count of primitives of a leaf, or zero for an interior node.
+		int right; // Right child of an interior node. The left child always follows its parent.
+		int axis; // Split axis of an interior node, along which the left child comes first.
+	};
+
+	static const int max_depth = 64; // Median splits keep the hierarchy depth logarithmic in the primitive count.
+
+	std::vector<sphere> primitives;
+	std::vector<node> nodes;
+
+	void collect(const hittable_list& list)
+	{
+		for (const auto& object : list.objects)
+		{
+			const hittable_list* nested_list = dynamic_cast<const hittable_list*>(object.get());
+
+			if (nested_list)
+			{
+				collect(*nested_list);
+			}
+			else
+			{
+				primitives.push_back(*static_cast<const sphere*>(object.get()));
+			}
+		}
+	}
+
+	int build(size_t start, size_t end)
+	{
+		int node_index = static_cast<int>(nodes.size());
+		nodes.push_back(node());
+
+		aabb bbox = aabb::empty;
+
+		for (size_t k = start; k < end; k++)
+		{
+			bbox = aabb(bbox, primitives[k].bounding_box());
+		}
+
+		nodes[node_index].bbox = bbox;
+
+		size_t object_span = end - start;
+
+		if (object_span <= 2)
+		{
+			nodes[node_index].start = static_cast<int>(start);
+			nodes[node_index].count = static_cast<int>(object_span);
+
+			return node_index;
+		}
+
+		int axis = bbox.longest_axis();
+
+		std::sort(primitives.begin() + start, primitives.begin() + end, [axis](const sphere& a, const sphere& b) {
+			return a.bounding_box().axis_interval(axis).min < b.bounding_box().axis_interval(axis).min;
+		});
+
+		size_t mid = start + object_span / 2;
+
+		build(start, mid);
+		int right = build(mid, end);
+
+		nodes[node_index].start = 0;
+		nodes[node_index].count = 0;
+		nodes[node_index].right = right;
+		nodes[node_index].axis = axis;
+
+		return node_index;
+	}
+
+	bool hit_node(int root, const ray& r, interval ray_ti, hit_record& rec) const
+	{
+		int stack[max_depth];
+		int stack_size = 0;
+		bool hit_anything = false;
+
+		stack[stack_size++] = root;
+
+		while (stack_size > 0)
+		{
+			int node_index = stack[--stack_size];
+			const node& n = nodes[node_index];
+
+			if (!n.bbox.hit(r, ray_ti))
+			{
+				continue;
+			}
+
+			if (n.count > 0)
+			{
+				for (int k = n.start; k < n.start + n.count; ++k)
+				{
+					if (primitives[k].hit(r, ray_ti, rec))
+					{
+						hit_anything = true;
+						ray_ti.max = rec.t;
+					}
+				}
+			}
+			else
+			{
+				// Visit the nearer child first, so that its hits shrink the interval tested in the farther one.
+				bool left_first = r.get_direction()[n.axis] >= 0.0;
+
+				stack[stack_size++] = left_first ? n.right : node_index + 1;
+				stack[stack_size++] = left_first ? node_index + 1 : n.right;
+			}
+		}
+
+		return hit_anything;
+	}
+};
+
+inline std::shared_ptr<hittable> make_scene(const hittable_list& list)
+{
+	// Picks the closed-world scene when every object is of a known type, and a hierarchy of virtual
+	// hittables otherwise.
+	if (static_scene::supports(list))
+	{
+		return std::make_shared<static_scene>(list);
+	}
+
+	return std::make_shared<bvh_node>(list);
+}
@@ -0,0 +1,828 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "common.h"
+
+#include "aabb.h"
+#include "hittable.h"
+#include "mapped_file.h"
+#include "material.h"
+#include "ray_packet.h"
+
+// Records of the scene file, written and mapped as they are. Every size is a multiple of 8 bytes, so that
+// records stay aligned wherever they follow each other.
+class streamed_sphere
+{
+public:
+	double center[3];
+	double radius;
+	uint32_t material_index; // Into the material palette of the scene.
+	uint32_t padding;
+
+	aabb bounding_box() const
+	{
+		return aabb(point3(center[0] - radius, center[1] - radius, center[2] - radius), point3(center[0] + radius, center[1] + radius, center[2] + radius));
+	}
+};
+
+class streamed_node
+{
+public:
+	double bounds[6]; // Minimum and maximum of the x, y and z axes.
+	int32_t start; // First item of a leaf.
+	int32_t count; // Count of items of a leaf, or zero for an interior node.
+	int32_t right; // Right child of an interior node. The left child always follows its parent.
+	int32_t axis; // Split axis of an interior node, along which the left child comes first.
+
+	aabb bounding_box() const
+	{
+		return aabb(interval(bounds[0], bounds[1]), interval(bounds[2], bounds[3]), interval(bounds[4], bounds[5]));
+	}
+};
+
+class streamed_chunk_entry
+{
+public:
+	uint64_t offset; // Of the chunk, in the file. A chunk is a "streamed_chunk_header", its nodes, then its spheres.
+	uint64_t size;
+	double bounds[6];
+
+	aabb bounding_box() const
+	{
+		return aabb(interval(bounds[0], bounds[1]), interval(bounds[2], bounds[3]), interval(bounds[4], bounds[5]));
+	}
+};
+
+class streamed_chunk_header
+{
+public:
+	uint32_t num_spheres;
+	uint32_t num_nodes;
+};
+
+class streamed_file_header
+{
+public:
+	char magic[8];
+	uint64_t num_chunks;
+	uint64_t table_offset; // Of the "streamed_chunk_entry" table, in the file.
+};
+
+inline void store_bounds(const aabb& box, double* bounds)
+{
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		bounds[2 * axis + 0] = box.axis_interval(axis).min;
+		bounds[2 * axis + 1] = box.axis_interval(axis).max;
+	}
+}
+
+template<class T>
+int build_streamed_hierarchy(std::vector<T>& items, size_t start, size_t end, std::vector<streamed_node>& nodes)
+{
+	// Median-split hierarchy over "items", reordered so that every leaf holds a range of them.
+	int node_index = static_cast<int>(nodes.size());
+	nodes.push_back(streamed_node());
+
+	aabb bbox = aabb::empty;
+
+	for (size_t k = start; k < end; k++)
+	{
+		bbox = aabb(bbox, items[k].bounding_box());
+	}
+
+	store_bounds(bbox, nodes[node_index].bounds);
+
+	size_t object_span = end - start;
+
+	if (object_span <= 2)
+	{
+		nodes[node_index].start = static_cast<int32_t>(start);
+		nodes[node_index].count = static_cast<int32_t>(object_span);
+
+		return node_index;
+	}
+
+	int axis = bbox.longest_axis();
+
+	std::sort(items.begin() + start, items.begin() + end, [axis](const T& a, const T& b) {
+		return a.bounding_box().axis_interval(axis).min < b.bounding_box().axis_interval(axis).min;
+	});
+
+	size_t mid = start + object_span / 2;
+
+	build_streamed_hierarchy(items, start, mid, nodes);
+	int right = build_streamed_hierarchy(items, mid, end, nodes);
+
+	nodes[node_index].start = 0;
+	nodes[node_index].count = 0;
+	nodes[node_index].right = right;
+	nodes[node_index].axis = axis;
+
+	return node_index;
+}
+
+// Writes a scene of spheres into a file that "streamed_scene" renders without loading it whole. Spheres
+// are spread over bucket files by coarse position as they are added; "finish" then sorts one bucket at a
+// time along a Morton curve and cuts it into chunks of nearby spheres, each under its own hierarchy. So
+// memory use is bounded by the largest bucket, about 1/64 of the scene if it is evenly spread.
+class streamed_scene_writer
+{
+public:
+	streamed_scene_writer(const std::string& _filename, const aabb& _bounds, int _chunk_capacity = 16384)
+		: filename(_filename), bounds(_bounds), chunk_capacity(_chunk_capacity), failed(false), finished(false)
+	{
+		for (int b = 0; b < num_buckets; ++b)
+		{
+			buckets[b] = std::fopen(bucket_filename(b).c_str(), "wb");
+			bucket_counts[b] = 0;
+			failed = failed || !buckets[b];
+		}
+	}
+
+	~streamed_scene_writer()
+	{
+		if (!finished)
+		{
+			remove_buckets();
+		}
+	}
+
+	void add(const point3& center, double radius, uint32_t material_index)
+	{
+		streamed_sphere s;
+
+		s.center[0] = center.x();
+		s.center[1] = center.y();
+		s.center[2] = center.z();
+		s.radius = radius;
+		s.material_index = material_index;
+		s.padding = 0;
+
+		// The top 6 bits of the Morton code split the bounds into 4x4x4 buckets.
+		int b = static_cast<int>(morton_code(s) >> 24);
+
+		if (buckets[b] && std::fwrite(&s, sizeof(s), 1, buckets[b]) == 1)
+		{
+			bucket_counts[b]++;
+		}
+		else
+		{
+			failed = true;
+		}
+	}
+
+	bool finish()
+	{
+		// Writes the scene file, returning whether it succeeded.
+		finished = true;
+
+		for (int b = 0; b < num_buckets; ++b)
+		{
+			if (buckets[b])
+			{
+				failed = std::fclose(buckets[b]) != 0 || failed;
+				buckets[b] = nullptr;
+			}
+		}
+
+		std::FILE* output = failed ? nullptr : std::fopen(filename.c_str(), "wb");
+		streamed_file_header header = { { 'R', 'T', 'S', 'T', 'R', 'M', '0', '1' }, 0, 0 };
+		std::vector<streamed_chunk_entry> table;
+		uint64_t offset = sizeof(header);
+
+		bool written = output && std::fwrite(&header, sizeof(header), 1, output) == 1;
+
+		for (int b = 0; b < num_buckets && written; ++b)
+		{
+			std::vector<streamed_sphere> spheres(bucket_counts[b]);
+			std::FILE* bucket = std::fopen(bucket_filename(b).c_str(), "rb");
+
+			written = bucket && std::fread(spheres.data(), sizeof(streamed_sphere), spheres.size(), bucket) == spheres.size();
+
+			if (bucket)
+			{
+				std::fclose(bucket);
+			}
+
+			std::remove(bucket_filename(b).c_str());
+
+			// Sorted along the Morton curve, so that consecutive spheres, hence chunks, are close in space.
+			std::vector<std::pair<uint32_t, size_t>> order(spheres.size());
+
+			for (size_t k = 0; k < spheres.size(); ++k)
+			{
+				order[k] = std::make_pair(morton_code(spheres[k]), k);
+			}
+
+			std::sort(order.begin(), order.end());
+
+			for (size_t chunk_start = 0; chunk_start < order.size() && written; chunk_start += chunk_capacity)
+			{
+				size_t chunk_end = std::min(chunk_start + chunk_capacity, order.size());
+				std::vector<streamed_sphere> chunk;
+				std::vector<streamed_node> nodes;
+
+				for (size_t k = chunk_start; k < chunk_end; ++k)
+				{
+					chunk.push_back(spheres[order[k].second]);
+				}
+
+				nodes.reserve(2 * chunk.size());
+				build_streamed_hierarchy(chunk, 0, chunk.size(), nodes);
+
+				streamed_chunk_header chunk_header = { static_cast<uint32_t>(chunk.size()), static_cast<uint32_t>(nodes.size()) };
+				streamed_chunk_entry entry;
+
+				entry.offset = offset;
+				entry.size = sizeof(chunk_header) + nodes.size() * sizeof(streamed_node) + chunk.size() * sizeof(streamed_sphere);
+				std::memcpy(entry.bounds, nodes[0].bounds, sizeof(entry.bounds));
+
+				written = std::fwrite(&chunk_header, sizeof(chunk_header), 1, output) == 1
+					&& std::fwrite(nodes.data(), sizeof(streamed_node), nodes.size(), output) == nodes.size()
+					&& std::fwrite(chunk.data(), sizeof(streamed_sphere), chunk.size(), output) == chunk.size();
+
+				table.push_back(entry);
+				offset += entry.size;
+			}
+		}
+
+		header.num_chunks = table.size();
+		header.table_offset = offset;
+
+		written = written && (table.empty() || std::fwrite(table.data(), sizeof(streamed_chunk_entry), table.size(), output) == table.size())
+			&& std::fseek(output, 0, SEEK_SET) == 0 && std::fwrite(&header, sizeof(header), 1, output) == 1;
+
+		if (output)
+		{
+			written = std::fclose(output) == 0 && written;
+		}
+
+		remove_buckets();
+
+		if (!written)
+		{
+			std::clog << "Failed to write streamed scene \"" << filename << "\"." << std::endl;
+		}
+
+		return written;
+	}
+
+private:
+	static const int num_buckets = 64;
+
+	std::string filename;
+	aabb bounds;
+	size_t chunk_capacity; // Most spheres per chunk.
+	std::FILE* buckets[num_buckets];
+	size_t bucket_counts[num_buckets];
+	bool failed, finished;
+
+	std::string bucket_filename(int b) const
+	{
+		return filename + ".bucket" + std::to_string(b);
+	}
+
+	void remove_buckets()
+	{
+		for (int b = 0; b < num_buckets; ++b)
+		{
+			if (buckets[b])
+			{
+				std::fclose(buckets[b]);
+				buckets[b] = nullptr;
+			}
+
+			std::remove(bucket_filename(b).c_str());
+		}
+	}
+
+	uint32_t morton_code(const streamed_sphere& s) const
+	{
+		// 10 bits per axis of the position of the center within the bounds, interleaved.
+		uint32_t code = 0;
+
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			const interval& extent = bounds.axis_interval(axis);
+			double t = extent.size() > 0.0 ? (s.center[axis] - extent.min) / extent.size() : 0.0;
+			uint32_t cell = static_cast<uint32_t>(std::min(std::max(t, 0.0), 1.0) * 1023.0);
+
+			for (int bit = 0; bit < 10; ++bit)
+			{
+				code |= ((cell >> bit) & 1u) << (3 * bit + 2 - axis);
+			}
+		}
+
+		return code;
+	}
+};
+
+class streaming_stats
+{
+public:
+	uint64_t chunk_requests = 0; // Chunk visits by rays and packets.
+	uint64_t chunk_loads = 0; // Visits that had to map the chunk.
+	uint64_t evictions = 0;
+	uint64_t resident_bytes = 0; // Of the chunks currently mapped by the cache.
+	uint64_t peak_resident_bytes = 0;
+};
+
+// Scene of spheres rendered straight from a file written by "streamed_scene_writer", for scenes that don't
+// fit in memory. Only the chunk table and a hierarchy over the chunk bounds stay in memory. Chunks are
+// mapped and checked when a ray first reaches them, and kept in a cache of bounded size from which chunks
+// not visited lately are unmapped (clock replacement). Visits of resident chunks don't lock; only loads
+// and evictions do. Packets visit each chunk once for all their lanes that reach it.
+class streamed_scene : public hittable
+{
+public:
+	streamed_scene(const std::string& filename, const std::vector<std::shared_ptr<material>>& _materials, uint64_t _resident_budget = uint64_t(1) << 30)
+		: file(filename), materials(_materials), resident_budget(_resident_budget)
+	{
+		std::shared_ptr<mapped_region> header_region = file.map(0, sizeof(streamed_file_header));
+
+		if (!header_region)
+		{
+			std::clog << "Failed to open streamed scene \"" << filename << "\"." << std::endl;
+
+			return;
+		}
+
+		streamed_file_header header;
+		std::memcpy(&header, header_region->data(), sizeof(header));
+
+		std::shared_ptr<mapped_region> table_region = file.map(header.table_offset, header.num_chunks * sizeof(streamed_chunk_entry));
+
+		// A scene without chunks, hence without a table, is empty but valid.
+		if (std::memcmp(header.magic, "RTSTRM01", 8) != 0 || (header.num_chunks > 0 && !table_region))
+		{
+			std::clog << "Invalid streamed scene \"" << filename << "\"." << std::endl;
+
+			return;
+		}
+
+		if (header.num_chunks == 0)
+		{
+			return;
+		}
+
+		chunks.resize(header.num_chunks);
+		std::memcpy(chunks.data(), table_region->data(), table_region->size());
+
+		nodes.reserve(2 * chunks.size());
+		build_streamed_hierarchy(chunks, 0, chunks.size(), nodes);
+
+		cache.reset(new cached_chunk[chunks.size()]);
+	}
+
+	bool hit(const ray& r, interval ray_ti, hit_record& rec) const override
+	{
+		return !nodes.empty() && hit_hierarchy(nodes.data(), r, ray_ti, [&](int start, int count, interval& ti) {
+			bool hit_anything = false;
+
+			for (int c = start; c < start + count; ++c)
+			{
+				const unsigned char* chunk = acquire(c);
+
+				if (!chunk)
+				{
+					continue;
+				}
+
+				if (hit_chunk(chunk, r, ti, rec))
+				{
+					hit_anything = true;
+					ti.max = rec.t;
+				}
+
+				release(c);
+			}
+
+			return hit_anything;
+		});
+	}
+
+	aabb bounding_box() const override
+	{
+		return nodes.empty() ? aabb::empty : nodes[0].bounding_box();
+	}
+
+	uint32_t hit_packet(const ray_packet& packet, uint32_t mask, double ray_tmin, packet_hit& hits) const override
+	{
+		if (nodes.empty())
+		{
+			return 0;
+		}
+
+		return hit_packet_hierarchy(nodes.data(), packet, mask, ray_tmin, hits, [&](int start, int count, uint32_t lanes) {
+			uint32_t hit_lanes = 0;
+
+			for (int c = start; c < start + count; ++c)
+			{
+				// Mapped once for every lane that reached the chunk.
+				const unsigned char* chunk = acquire(c);
+
+				if (chunk)
+				{
+					hit_lanes |= hit_packet_chunk(chunk, packet, lanes, ray_tmin, hits);
+					release(c);
+				}
+			}
+
+			return hit_lanes;
+		});
+	}
+
+	streaming_stats get_stats() const
+	{
+		std::lock_guard<std::mutex> lock(cache_mutex);
+		streaming_stats current = stats;
+
+		for (size_t c = 0; c < chunks.size(); ++c)
+		{
+			current.chunk_requests += cache[c].requests.load(std::memory_order_relaxed);
+		}
+
+		return current;
+	}
+
+private:
+	class cached_chunk
+	{
+	public:
+		std::atomic<const mapped_region*> region{ nullptr }; // Null while not resident.
+		std::atomic<int> users{ 0 }; // Rays reading the chunk, which can't be unmapped until they are done.
+		std::atomic<bool> referenced{ false }; // Visited since the clock hand last passed.
+		std::atomic<uint64_t> requests{ 0 }; // Kept per chunk, so that visits don't all write one counter.
+
+		// Only touched under the cache lock.
+		std::shared_ptr<const mapped_region> mapping;
+		bool invalid = false; // Failed to map or to pass the checks, and never tried again.
+	};
+
+	static const int max_depth = 64;
+
+	mapped_file file;
+	std::vector<std::shared_ptr<material>> materials;
+	uint64_t resident_budget; // Bytes of chunks the cache keeps mapped. The chunk just loaded is kept even beyond it.
+	std::vector<streamed_chunk_entry> chunks;
+	std::vector<streamed_node> nodes; // Hierarchy over the chunks.
+
+	mutable std::mutex cache_mutex; // Held to load and evict chunks.
+	std::unique_ptr<cached_chunk[]> cache;
+	mutable std::vector<int> resident; // Resident chunks, in the order the clock hand sweeps them.
+	mutable size_t clock_hand = 0;
+	mutable streaming_stats stats;
+
+	const unsigned char* acquire(int c) const
+	{
+		// Returns the mapped chunk, or null if it can't be read. A chunk returned stays mapped until "release(c)".
+		cached_chunk& entry = cache[c];
+
+		entry.requests.fetch_add(1, std::memory_order_relaxed);
+
+		// Counted as a user before reading the region, so an eviction clearing it afterwards sees the count.
+		entry.users.fetch_add(1);
+
+		const mapped_region* region = entry.region.load();
+
+		if (region)
+		{
+			if (!entry.referenced.load(std::memory_order_relaxed))
+			{
+				entry.referenced.store(true, std::memory_order_relaxed);
+			}
+
+			return region->data();
+		}
+
+		entry.users.fetch_sub(1);
+
+		return load(c);
+	}
+
+	void release(int c) const
+	{
+		cache[c].users.fetch_sub(1, std::memory_order_release);
+	}
+
+	const unsigned char* load(int c) const
+	{
+		std::lock_guard<std::mutex> lock(cache_mutex);
+		cached_chunk& entry = cache[c];
+
+		// Another ray may have loaded it meanwhile. Evictions also take the lock, so it stays resident.
+		if (entry.mapping)
+		{
+			entry.users.fetch_add(1);
+
+			return entry.mapping->data();
+		}
+
+		if (entry.invalid)
+		{
+			return nullptr;
+		}
+
+		entry.mapping = file.map(chunks[c].offset, static_cast<size_t>(chunks[c].size));
+
+		if (!entry.mapping || !valid_chunk(entry.mapping->data(), chunks[c].size))
+		{
+			std::clog << '\n' << "Invalid chunk " << c << " of streamed scene, skipped." << std::endl;
+
+			entry.mapping.reset();
+			entry.invalid = true;
+
+			return nullptr;
+		}
+
+		stats.chunk_loads++;
+		stats.resident_bytes += chunks[c].size;
+
+		while (stats.resident_bytes > resident_budget && !resident.empty())
+		{
+			clock_hand %= resident.size();
+
+			cached_chunk& victim = cache[resident[clock_hand]];
+
+			// Chunks visited since the last sweep get another round.
+			if (victim.referenced.exchange(false, std::memory_order_relaxed))
+			{
+				clock_hand++;
+				continue;
+			}
+
+			// Rays that read the region before it was cleared may still be testing it, and are short. The
+			// store and the loads of "users" are sequentially consistent, as are the increment and load in
+			// "acquire", so that either the ray sees the cleared region or this sees the ray's count.
+			victim.region.store(nullptr);
+
+			while (victim.users.load() > 0)
+			{
+				std::this_thread::yield();
+			}
+
+			victim.mapping.reset();
+
+			stats.evictions++;
+			stats.resident_bytes -= chunks[resident[clock_hand]].size;
+
+			resident[clock_hand] = resident.back();
+			resident.pop_back();
+		}
+
+		stats.peak_resident_bytes = std::max(stats.peak_resident_bytes, stats.resident_bytes);
+
+		resident.push_back(c);
+		entry.referenced.store(true, std::memory_order_relaxed);
+		entry.users.fetch_add(1);
+		entry.region.store(entry.mapping.get());
+
+		return entry.mapping->data();
+	}
+
+	bool valid_chunk(const unsigned char* data, uint64_t size) const
+	{
+		// Checks that the chunk's records fit in it and only refer to each other and to the palette, since
+		// the traversal trusts them.
+		streamed_chunk_header header;
+
+		if (size < sizeof(header))
+		{
+			return false;
+		}
+
+		std::memcpy(&header, data, sizeof(header));
+
+		if (header.num_nodes == 0 || sizeof(header) + uint64_t(header.num_nodes) * sizeof(streamed_node) + uint64_t(header.num_spheres) * sizeof(streamed_sphere) > size)
+		{
+			return false;
+		}
+
+		const streamed_node* chunk_nodes = reinterpret_cast<const streamed_node*>(data + sizeof(header));
+		const streamed_sphere* spheres = reinterpret_cast<const streamed_sphere*>(chunk_nodes + header.num_nodes);
+
+		// Children come after their parent, so the hierarchy has no cycles, and depths are known in order.
+		std::vector<int> depths(header.num_nodes, 0);
+
+		for (uint32_t k = 0; k < header.num_nodes; ++k)
+		{
+			const streamed_node& n = chunk_nodes[k];
+
+			// The traversal stack holds at most one node more than the depth.
+			if (depths[k] + 1 >= max_depth)
+			{
+				return false;
+			}
+
+			if (n.count > 0)
+			{
+				if (n.start < 0 || uint64_t(n.start) + uint64_t(n.count) > header.num_spheres)
+				{
+					return false;
+				}
+			}
+			else
+			{
+				if (n.count < 0 || n.axis < 0 || n.axis > 2 || k + 1 >= header.num_nodes || n.right <= static_cast<int64_t>(k) + 1 || uint32_t(n.right) >= header.num_nodes)
+				{
+					return false;
+				}
+
+				depths[k + 1] = std::max(depths[k + 1], depths[k] + 1);
+				depths[n.right] = std::max(depths[n.right], depths[k] + 1);
+			}
+		}
+
+		for (uint32_t k = 0; k < header.num_spheres; ++k)
+		{
+			if (spheres[k].material_index >= materials.size())
+			{
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	bool hit_chunk(const unsigned char* data, const ray& r, interval& ray_ti, hit_record& rec) const
+	{
+		streamed_chunk_header header;
+		std::memcpy(&header, data, sizeof(header));
+
+		const streamed_node* chunk_nodes = reinterpret_cast<const streamed_node*>(data + sizeof(header));
+		const streamed_sphere* spheres = reinterpret_cast<const streamed_sphere*>(chunk_nodes + header.num_nodes);
+
+		return hit_hierarchy(chunk_nodes, r, ray_ti, [&](int start, int count, interval& ti) {
+			bool hit_anything = false;
+
+			for (int k = start; k < start + count; ++k)
+			{
+				if (hit_sphere(spheres[k], r, ti, rec))
+				{
+					hit_anything = true;
+					ti.max = rec.t;
+				}
+			}
+
+			return hit_anything;
+		});
+	}
+
+	uint32_t hit_packet_chunk(const unsigned char* data, const ray_packet& packet, uint32_t mask, double ray_tmin, packet_hit& hits) const
+	{
+		streamed_chunk_header header;
+		std::memcpy(&header, data, sizeof(header));
+
+		const streamed_node* chunk_nodes = reinterpret_cast<const streamed_node*>(data + sizeof(header));
+		const streamed_sphere* spheres = reinterpret_cast<const streamed_sphere*>(chunk_nodes + header.num_nodes);
+
+		return hit_packet_hierarchy(chunk_nodes, packet, mask, ray_tmin, hits, [&](int start, int count, uint32_t lanes) {
+			uint32_t hit_lanes = 0;
+
+			for (int k = start; k < start + count; ++k)
+			{
+				for (int lane = 0; lane < packet_size; ++lane)
+				{
+					if ((lanes & (1u << lane)) && hit_sphere(spheres[k], packet.rays[lane], interval(ray_tmin, hits.t_max[lane]), hits.recs[lane]))
+					{
+						hits.t_max[lane] = hits.recs[lane].t;
+						hit_lanes |= 1u << lane;
+					}
+				}
+			}
+
+			return hit_lanes;
+		});
+	}
+
+	bool hit_sphere(const streamed_sphere& s, const ray& r, const interval& ray_ti, hit_record& rec) const
+	{
+		// Same test as "sphere::hit", but the attributes are filled in right away: the chunk holding the
+		// sphere may be unmapped by the time the closest hit is known.
+		point3 center(s.center[0], s.center[1], s.center[2]);
+		vec3 oc = r.get_origin() - center;
+
+		double a = r.get_direction().length_squared();
+		double half_b = dot(oc, r.get_direction());
+		double c = oc.length_squared() - s.radius * s.radius;
+		double discriminant = half_b * half_b - a * c;
+
+		if (discriminant < 0) return false;
+
+		double sqrtd = sqrt(discriminant);
+
+		// Find the nearest root that lies in the acceptable range.
+		double root = (-half_b - sqrtd) / a;
+
+		if (!ray_ti.surrounds(root))
+		{
+			root = (-half_b + sqrtd) / a;
+
+			if (!ray_ti.surrounds(root))
+			{
+				return false;
+			}
+		}
+
+		rec.t = root;
+		rec.object = nullptr;
+		rec.p = r.at(root);
+		rec.set_face_normal(r, (rec.p - center) / s.radius);
+		rec.mat = materials[s.material_index].get();
+
+		return true;
+	}
+
+	template<class Leaf>
+	static bool hit_hierarchy(const streamed_node* hierarchy, const ray& r, interval& ray_ti, Leaf leaf)
+	{
+		// "leaf(start, count, ray_ti)" tests the items of a leaf, shrinking "ray_ti" on hits.
+		int stack[max_depth];
+		int stack_size = 0;
+		bool hit_anything = false;
+
+		stack[stack_size++] = 0;
+
+		while (stack_size > 0)
+		{
+			int node_index = stack[--stack_size];
+			const streamed_node& n = hierarchy[node_index];
+
+			if (!n.bounding_box().hit(r, ray_ti))
+			{
+				continue;
+			}
+
+			if (n.count > 0)
+			{
+				hit_anything = leaf(n.start, n.count, ray_ti) || hit_anything;
+			}
+			else
+			{
+				// Visit the nearer child first, so that its hits shrink the interval tested in the farther one.
+				bool left_first = r.get_direction()[n.axis] >= 0.0;
+
+				stack[stack_size++] = left_first ? n.right : node_index + 1;
+				stack[stack_size++] = left_first ? node_index + 1 : n.right;
+			}
+		}
+
+		return hit_anything;
+	}
+
+	template<class Leaf>
+	static uint32_t hit_packet_hierarchy(const streamed_node* hierarchy, const ray_packet& packet, uint32_t mask, double ray_tmin, packet_hit& hits, Leaf leaf)
+	{
+		// "leaf(start, count, lanes)" tests the items of a leaf for the lanes that reach it, returning the lanes that hit.
+		int stack_nodes[max_depth];
+		uint32_t stack_masks[max_depth];
+		int stack_size = 0;
+		uint32_t hit_lanes = 0;
+
+		stack_nodes[stack_size] = 0;
+		stack_masks[stack_size++] = mask;
+
+		while (stack_size > 0)
+		{
+			stack_size--;
+
+			int node_index = stack_nodes[stack_size];
+			const streamed_node& n = hierarchy[node_index];
+			uint32_t lanes = n.bounding_box().hit_packet(packet, stack_masks[stack_size], ray_tmin, hits.t_max);
+
+			if (lanes == 0)
+			{
+				continue;
+			}
+
+			if (n.count > 0)
+			{
+				hit_lanes |= leaf(n.start, n.count, lanes);
+			}
+			else
+			{
+				// Coherent lanes share their direction signs, so the first lane decides the nearer child.
+				bool left_first = packet.inv_direction[n.axis][0] >= 0.0;
+
+				stack_nodes[stack_size] = left_first ? n.right : node_index + 1;
+				stack_masks[stack_size++] = lanes;
+				stack_nodes[stack_size] = left_first ? node_index + 1 : n.right;
+				stack_masks[stack_size++] = lanes;
+			}
+		}
+
+		return hit_lanes;
+	}
+};
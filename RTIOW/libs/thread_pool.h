@@ -10,8 +10,15 @@
 class thread_pool
 {
 public:
-	thread_pool() : stop(false), num_enqueued_tasks(0), num_dispatched_tasks(0) { initalize(std::thread::hardware_concurrency()); }
-	thread_pool(int num_threads) : stop(false), num_enqueued_tasks(0), num_dispatched_tasks(0) { initalize(num_threads); }
+	bool print_progress = false; // Print "Tasks: dispatched/enqueued" as tasks start. Set before enqueuing.
+
+	thread_pool() : stop(false), num_enqueued_tasks(0), num_dispatched_tasks(0), num_running_tasks(0) { initalize(std::thread::hardware_concurrency()); }
+	thread_pool(int num_threads) : stop(false), num_enqueued_tasks(0), num_dispatched_tasks(0), num_running_tasks(0) { initalize(num_threads); }
+
+	int size() const
+	{
+		return static_cast<int>(workers.size());
+	}
 
 	template<class F>
 	void enqueue(F&& task)
@@ -25,6 +32,14 @@ public:
 		condition.notify_one();
 	}
 
+	// Blocks until every enqueued task has finished, keeping the workers alive for more work.
+	void wait()
+	{
+		std::unique_lock<std::mutex> lock(queue_mutex);
+
+		idle.wait(lock, [this] { return tasks.empty() && num_running_tasks == 0; });
+	}
+
 	void terminate()
 	{
 		std::unique_lock<std::mutex> lock(queue_mutex);
@@ -45,8 +60,9 @@ private:
 	std::queue<std::function<void()>> tasks;
 	std::mutex queue_mutex;
 	std::condition_variable condition;
+	std::condition_variable idle;
 	bool stop;
-	uint32_t num_enqueued_tasks, num_dispatched_tasks;
+	uint32_t num_enqueued_tasks, num_dispatched_tasks, num_running_tasks;
 
 	void initalize(int num_threads)
 	{
@@ -64,13 +80,25 @@ private:
 					auto task = std::move(tasks.front());
 					tasks.pop();
 					num_dispatched_tasks++;
+					num_running_tasks++;
 
-					std::clog << '\r' << "Tasks: " << num_dispatched_tasks << "/" << num_enqueued_tasks << "        " << std::flush;
+					if (print_progress)
+					{
+						std::clog << '\r' << "Tasks: " << num_dispatched_tasks << "/" << num_enqueued_tasks << "        " << std::flush;
+					}
 
 					lock.unlock();
 
 					// Execute the task.
 					task();
+
+					lock.lock();
+					num_running_tasks--;
+
+					if (tasks.empty() && num_running_tasks == 0)
+					{
+						idle.notify_all();
+					}
 				}
 			});
 		}
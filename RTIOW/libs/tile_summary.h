@@ -0,0 +1,107 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "common.h"
+
+class material;
+
+// Record of what the paths of one tile touched: the world-space cells their vertices fell in and the
+// materials they hit, kept as a sorted set of keys. Its size follows the count of distinct cells, not the
+// count of samples, and lookups are exact up to collisions of the 64-bit keys.
+class tile_summary
+{
+public:
+	tile_summary() : sorted_size(0) {}
+
+	void clear()
+	{
+		keys.clear();
+		sorted_size = 0;
+	}
+
+	void add_point(const point3& p, double cell_size)
+	{
+		add_key(cell_key(p, cell_size));
+	}
+
+	void add_material(const material* mat)
+	{
+		add_key(material_key(mat));
+	}
+
+	void finish()
+	{
+		// Called once the tile is rendered, before any lookup.
+		compact();
+		keys.shrink_to_fit();
+	}
+
+	bool contains_key(uint64_t key) const
+	{
+		return std::binary_search(keys.begin(), keys.end(), key);
+	}
+
+	static uint64_t cell_key(int64_t x, int64_t y, int64_t z)
+	{
+		return mix(static_cast<uint64_t>(x) * 0x9E3779B97F4A7C15ull ^ static_cast<uint64_t>(y) * 0xC2B2AE3D27D4EB4Full ^ static_cast<uint64_t>(z) * 0x165667B19E3779F9ull);
+	}
+
+	static uint64_t cell_key(const point3& p, double cell_size)
+	{
+		return cell_key(cell_index(p.x(), cell_size), cell_index(p.y(), cell_size), cell_index(p.z(), cell_size));
+	}
+
+	static uint64_t material_key(const material* mat)
+	{
+		// Salted, so that material keys never collide with cell keys by construction.
+		return mix(reinterpret_cast<uintptr_t>(mat) ^ 0xD6E8FEB86659FD93ull);
+	}
+
+	static int64_t cell_index(double coordinate, double cell_size)
+	{
+		return static_cast<int64_t>(std::floor(coordinate / cell_size));
+	}
+
+private:
+	std::vector<uint64_t> keys;
+	size_t sorted_size; // Count of keys, sorted and unique, at the last compaction.
+
+	void add_key(uint64_t key)
+	{
+		// Neighbouring vertices often fall in the same cell, so repeats of the last key are dropped early.
+		if (!keys.empty() && keys.back() == key)
+		{
+			return;
+		}
+
+		keys.push_back(key);
+
+		// Compacted whenever the keys doubled, so memory stays within a small factor of the distinct count.
+		if (keys.size() >= 2 * sorted_size + 1024)
+		{
+			compact();
+		}
+	}
+
+	void compact()
+	{
+		std::sort(keys.begin(), keys.end());
+		keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+		sorted_size = keys.size();
+	}
+
+	static uint64_t mix(uint64_t x)
+	{
+		// Finalizer of SplitMix64.
+		x ^= x >> 30;
+		x *= 0xBF58476D1CE4E5B9ull;
+		x ^= x >> 27;
+		x *= 0x94D049BB133111EBull;
+		x ^= x >> 31;
+
+		return x;
+	}
+};
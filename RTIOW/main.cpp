@@ -2,6 +2,7 @@
 
 #define STB_IMAGE_IMPLEMENTATION
 #define STB_IMAGE_WRITE_IMPLEMENTATION
+#define STB_IMAGE_RESIZE_IMPLEMENTATION
 #define _CRT_SECURE_NO_WARNINGS // FIXME.
 
 #include "libs/common.h"
@@ -10,12 +11,15 @@
 #include "libs/sphere.h"
 #include "libs/hittable.h"
 #include "libs/hittable_list.h"
+#include "libs/bvh.h"
+#include "libs/static_scene.h"
 #include "libs/camera.h"
 #include "libs/material.h"
+#include "libs/environment.h"
+#include "libs/render_daemon.h"
 
-int main()
+hittable_list book1_scene()
 {
-	// World.
 	hittable_list world;
 
 	auto ground_material = std::make_shared<lambertian>(color(0.5, 0.5, 0.5));
@@ -68,6 +72,35 @@ int main()
 	auto material3 = std::make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
 	world.add(std::make_shared<sphere>(point3(4.0, 1.0, 0.0), 1.0, material3));
 
+	return hittable_list(make_scene(world));
+}
+
+int main(int argc, char* argv[])
+{
+	// Serve render jobs from the spool directory given after "--serve", on one pool for all of them.
+	if (argc > 1 && std::string(argv[1]) == "--serve")
+	{
+		if (argc < 3)
+		{
+			std::clog << "Usage: RTIOW [environment.hdr] | RTIOW --serve <spool directory>" << std::endl;
+
+			return 1;
+		}
+
+		thread_pool pool;
+		render_daemon daemon(argv[2], pool);
+
+		daemon.add_scene("book1", [] { return std::make_shared<hittable_list>(book1_scene()); });
+		daemon.run();
+
+		pool.terminate();
+
+		return 0;
+	}
+
+	// World.
+	hittable_list world = book1_scene();
+
 	// Camera.
 	camera cam;
 
@@ -84,6 +117,12 @@ int main()
 	cam.defocus_angle = 0.6;
 	cam.focus_distance = 10.0;
 
+	// Optional equirectangular HDR environment map, given as the first argument.
+	if (argc > 1)
+	{
+		cam.environment = environment_light::load(argv[1]);
+	}
+
 	cam.render_mt(world, "outputs/book1/image.jpg");
 
 	return 0;